@@ -0,0 +1,71 @@
+#pragma once
+// 16-bit floating point dagscores. The scores are converted to float when the candidates of a step are gathered,
+// so the rest of the search does not depend on the input precision.
+//
+// half_to_float uses F16C when the compiler targets it (-mf16c or -march=native), a few integer operations otherwise.
+// bf16 is the upper half of a float, its conversion is a shift either way.
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+struct Half // IEEE 754 binary16
+{
+    uint16_t bits;
+};
+
+struct BFloat16 // the upper 16 bits of an IEEE 754 binary32
+{
+    uint16_t bits;
+};
+
+inline float bits_to_float(uint32_t bits){
+    float res;
+    memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+inline uint32_t float_to_bits(float value){
+    uint32_t res;
+    memcpy(&res, &value, sizeof(res));
+    return res;
+}
+
+inline float to_float(float value){ return value; }
+
+inline float to_float(Half value){
+#ifdef __F16C__
+    return _cvtsh_ss(value.bits);
+#else
+    uint32_t sign = (uint32_t)(value.bits & 0x8000) << 16;
+    uint32_t rest = value.bits & 0x7fff;
+    if(rest >= 0x7c00) return bits_to_float(sign | 0x7f800000 | (rest & 0x3ff) << 13); // inf and nan
+    // shifting puts the exponent and mantissa in place, scaling by 2^112 = 2^(127 - 15) fixes the bias and normalizes subnormals
+    return bits_to_float(sign | float_to_bits(bits_to_float(rest << 13) * 5.192296858534828e33f));
+#endif
+}
+
+inline float to_float(BFloat16 value){
+    return bits_to_float((uint32_t)value.bits << 16);
+}
+
+// Round to nearest even. Only used to prepare inputs, the search never converts this way.
+inline Half float_to_half(float value){
+    uint32_t bits = float_to_bits(value);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if(bits >= 0x7f800000) return {(uint16_t)(sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00))};
+    if(bits >= 0x477ff000) return {(uint16_t)(sign | 0x7c00)}; // 65520 and above round to inf
+    if(bits < 0x38800000) return {(uint16_t)(sign | (uint16_t)std::nearbyint(bits_to_float(bits) * 16777216.0f))}; // subnormal
+    bits += 0xc8000fff + ((bits >> 13) & 1); // rebias the exponent and round the dropped 13 bits
+    return {(uint16_t)(sign | (bits >> 13))};
+}
+
+inline BFloat16 float_to_bfloat16(float value){
+    uint32_t bits = float_to_bits(value);
+    if(std::isnan(value)) return {(uint16_t)((bits >> 16) | 0x40)}; // keep it a quiet nan
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return {(uint16_t)(bits >> 16)};
+}
@@ -0,0 +1,14 @@
+#include "LogSpace.h"
+
+Log1pExpTable::Log1pExpTable()
+{
+    for(int i = 0; i < size; i++){
+        double mid = (i + 0.5) / steps_per_unit;
+        double e = std::exp(-mid);
+        coefs[i].c0 = std::log1p(e);
+        coefs[i].c1 = -e / (1 + e);
+        coefs[i].c2 = e / ((1 + e) * (1 + e)) / 2;
+    }
+}
+
+const Log1pExpTable log1pexp_table;
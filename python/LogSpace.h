@@ -0,0 +1,96 @@
+#pragma once
+// Log-space arithmetic used to accumulate path scores.
+//
+// The fast versions avoid libm in the inner loops: logaddexp reads log1p(exp(-d)) from a table with quadratic
+// interpolation, logsumexp uses a polynomial exp and a single log. Both stay within about 2e-7 (absolute, plus
+// one ulp of the result) of the exact values, see log_space_test.cc.
+// Build with -DDAG_SEARCH_EXACT_LOGSPACE to make logaddexp / logsumexp use libm.
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+class Log1pExpTable // log1p(exp(-d)) for d in [0, range), one quadratic per interval, expanded at its midpoint
+{
+public:
+    static const int steps_per_unit = 32;
+    static const int range = 20; // log1p(exp(-20)) < 3e-9
+    static const int size = range * steps_per_unit;
+
+    struct Coef
+    {
+        float c0, c1, c2;
+    };
+    Coef coefs[size];
+
+    Log1pExpTable();
+
+    float operator()(float d) const { // needs 0 <= d < range
+        int idx = (int)(d * steps_per_unit);
+        float t = d - (idx + 0.5f) * (1.0f / steps_per_unit);
+        const Coef &coef = coefs[idx];
+        return coef.c0 + t * (coef.c1 + t * coef.c2);
+    }
+};
+
+extern const Log1pExpTable log1pexp_table;
+
+inline float exact_logaddexp(float a, float b){
+    float l = std::max(a, b);
+    if(std::isinf(l) != 0) return -INFINITY;
+    return std::log(std::exp(a - l) + std::exp(b - l)) + l;
+}
+
+inline float fast_logaddexp(float a, float b){
+    float l = std::max(a, b);
+    if(std::isinf(l) != 0) return -INFINITY;
+    float d = std::fabs(a - b);
+    if(d < Log1pExpTable::range) return l + log1pexp_table(d);
+    return d == d ? l : d; // propagate nan
+}
+
+// exp(x) with a relative error below 2e-7, branch-free for x <= 0 so that loops over it vectorize
+inline float fast_exp_nonpositive(float x){
+    x = std::max(x, -87.0f); // exp(-87) is about the smallest normal float
+    float n = std::floor(x * 1.44269504088896341f + 0.5f);
+    float r = x - n * 0.693359375f; // ln(2) split in two parts, Cephes expf
+    r = r + n * 2.12194440e-4f;
+    float p = 1.9875691500E-4f;
+    p = p * r + 1.3981999507E-3f;
+    p = p * r + 8.3334519073E-3f;
+    p = p * r + 4.1665795894E-2f;
+    p = p * r + 1.6666665459E-1f;
+    p = p * r + 5.0000001201E-1f;
+    p = p * r * r + r + 1.0f;
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+inline float exact_logsumexp(const float* x, int n){
+    float l = -INFINITY;
+    for(int i = 0; i < n; i++) l = std::max(l, x[i]);
+    if(std::isinf(l) != 0) return -INFINITY;
+    float sum = 0;
+    for(int i = 0; i < n; i++) sum += std::exp(x[i] - l);
+    return std::log(sum) + l;
+}
+
+inline float fast_logsumexp(const float* x, int n){
+    float l = -INFINITY;
+    for(int i = 0; i < n; i++) l = std::max(l, x[i]);
+    if(std::isinf(l) != 0) return -INFINITY;
+    float sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for(int i = 0; i < n; i++) sum += fast_exp_nonpositive(x[i] - l);
+    return std::log(sum) + l;
+}
+
+#ifdef DAG_SEARCH_EXACT_LOGSPACE
+inline float logaddexp(float a, float b){ return exact_logaddexp(a, b); }
+inline float logsumexp(const float* x, int n){ return exact_logsumexp(x, n); }
+#else
+inline float logaddexp(float a, float b){ return fast_logaddexp(a, b); }
+inline float logsumexp(const float* x, int n){ return fast_logsumexp(x, n); }
+#endif
@@ -7,6 +7,7 @@
 #include <cstdio>
 #include <cstdarg>
 #include <cstdlib>
+#include <cstring>
 #include <omp.h>
 #include "lm/state.hh"
 #include "lm/virtual_interface.hh"
@@ -15,8 +16,6 @@
 #include "memviewslice.h"
 using namespace std;
 
-bool initialized=false;
-
 template<class T, class Func>
 T** create_and_init(int arr_length, Func func){
     T** res = new T*[arr_length];
@@ -26,74 +25,102 @@ T** create_and_init(int arr_length, Func func){
     return res;
 }
 
-MultiThreadMemPool<SearchNode> sn_pool;
-template<>
-MultiThreadMemPool<SearchNode>::ThreadBuffer MultiThreadMemPool<SearchNode>::tbuf = MultiThreadMemPool<SearchNode>::ThreadBuffer();
-MultiThreadMemPool<Notify> ntf_pool;
-template<>
-MultiThreadMemPool<Notify>::ThreadBuffer MultiThreadMemPool<Notify>::tbuf = MultiThreadMemPool<Notify>::ThreadBuffer();
-#ifdef QUICKMAP_DEBUG
-template<>
-int QuickMap<int, float, SearchNode::QuickMapSize, dagstep_get_or_create>::access = 0;
-template<>
-int QuickMap<int, float, SearchNode::QuickMapSize, dagstep_get_or_create>::hard_access = 0;
-#endif
+template<class T>
+void delete_all(T** arr, int arr_length){
+    for(int i = 0; i < arr_length; i++) delete arr[i];
+    delete[] arr;
+}
 
-NodeNotifyMap** node_notify_map_atomic;
-int max_pos, max_batch_size;
+inline float lm_full_score(const lm::base::Model* model, const lm::ngram::State &in, lm::WordIndex word, lm::ngram::State &out){
+    return model->BaseScore(&in, word, &out);
+}
 
-lm::base::Model* model;
+template<class Model>
+inline float lm_full_score(const Model* model, const lm::ngram::State &in, lm::WordIndex word, lm::ngram::State &out){
+    return model->FullScore(in, word, out).prob;
+}
 
-vector<pair<float, SearchNode*>>** beams;
-MultiThreadMemPool<NodeStepMap::Node> ns_pool;
-template<>
-MultiThreadMemPool<NodeStepMap::Node>::ThreadBuffer MultiThreadMemPool<NodeStepMap::Node>::tbuf = MultiThreadMemPool<NodeStepMap::Node>::ThreadBuffer();
-MultiThreadMemPool<NodeChildrenMap::Node> nc_pool;
-template<>
-MultiThreadMemPool<NodeChildrenMap::Node>::ThreadBuffer MultiThreadMemPool<NodeChildrenMap::Node>::tbuf = MultiThreadMemPool<NodeChildrenMap::Node>::ThreadBuffer();
-MultiThreadMemPool<NodeNotifyMap::Node> nn_pool;
-template<>
-MultiThreadMemPool<NodeNotifyMap::Node>::ThreadBuffer MultiThreadMemPool<NodeNotifyMap::Node>::tbuf = MultiThreadMemPool<NodeNotifyMap::Node>::ThreadBuffer();
-NodeStepMap** node_step_map;
-NodeChildrenMap** node_children_map;
+template<class Model>
+void lm_score_pending(LMTransitionCache &cache, DagSearcher* searcher){
+    cache.score_pending(searcher, static_cast<const Model*>(searcher->model));
+}
 
+void lm_virtual_score_pending(LMTransitionCache &cache, DagSearcher* searcher){
+    lm_score_pending<lm::base::Model>(cache, searcher);
+}
 
+// The same switch as lm::ngram::LoadVirtual, so that the cast in lm_score_pending matches the loaded model
+LMScorePendingFunction select_lm_score_pending(lm::ngram::ModelType model_type){
+    using namespace lm::ngram;
+    switch(model_type){
+        case PROBING: return lm_score_pending<ProbingModel>;
+        case REST_PROBING: return lm_score_pending<RestProbingModel>;
+        case TRIE: return lm_score_pending<TrieModel>;
+        case QUANT_TRIE: return lm_score_pending<QuantTrieModel>;
+        case ARRAY_TRIE: return lm_score_pending<ArrayTrieModel>;
+        case QUANT_ARRAY_TRIE: return lm_score_pending<QuantArrayTrieModel>;
+        default: return lm_virtual_score_pending;
+    }
+}
 
-static NotifyCache thread_notify_cache;
-static ExpandBeamCache thread_expand_cache;
-# pragma omp threadprivate(thread_notify_cache, thread_expand_cache)
+LMStateTable* create_lm_state_table(int order, int hash_size, int thread_num){
+    if(order <= 3) return new CompactLMStateTable<3>(hash_size, thread_num);
+    if(order == 4) return new CompactLMStateTable<4>(hash_size, thread_num);
+    if(order == 5) return new CompactLMStateTable<5>(hash_size, thread_num);
+    return new CompactLMStateTable<KENLM_MAX_ORDER>(hash_size, thread_num);
+}
 
+#ifdef QUICKMAP_DEBUG
+template<>
+int QuickMap<int, float, SearchNodeState::QuickMapSize, dagstep_get_or_create>::access = 0;
+template<>
+int QuickMap<int, float, SearchNodeState::QuickMapSize, dagstep_get_or_create>::hard_access = 0;
+#endif
 
-void global_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int thread_num, char* lm_path)
+size_t DagSearcher::pool_allocated_bytes()
 {
-    //__printf("enter init\n");
-    assert(!initialized);
-    initialized = true;
+    return sn_pool.allocated_bytes() + node_states.allocated_bytes() + ntf_pool.allocated_bytes() + ns_pool.allocated_bytes() +
+        nc_pool.allocated_bytes() + (lm_states ? lm_states->allocated_bytes() : 0) + seg_pool.allocated_bytes() + hc_pool.allocated_bytes();
+}
 
+// dyn-var is a setting of the calling thread, so it is set before each parallel region: searches may be started from
+// any thread (an executor worker, another Python thread) and must get a team of all thread_num threads.
+static inline void request_full_team()
+{
     omp_set_dynamic(0);
-    omp_set_num_threads(thread_num);
-    __printf("create batch_size=%d beam_size=%d top_cand_n=%d maxpos=%d maxtoken=%d thread_num=%d\n", batch_size, beam_size, top_cand_n, maxpos, maxtoken, thread_num);
+}
+
+DagSearcher::DagSearcher(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int _thread_num, int pool_reserve, char* lm_path)
+{
+    //__printf("enter init\n");
+    thread_num = _thread_num;
+    __printf("create batch_size=%d beam_size=%d top_cand_n=%d maxpos=%d maxtoken=%d thread_num=%d pool_reserve=%d\n", batch_size, beam_size, top_cand_n, maxpos, maxtoken, thread_num, pool_reserve);
 
     max_batch_size = batch_size;
-    int mempool_size = beam_size * top_cand_n * maxtoken + MultiThreadMemPool<SearchNode*>::buf_per_thread * thread_num * 2;
-    // printf("mempool_size=%d\n", mempool_size);
-    __printf("dagsearch allocating %.2f GB memory on this worker\n",
-        (float(mempool_size) * (sizeof(SearchNode) + sizeof(Notify) + sizeof(NodeStepMap::Node) + sizeof(NodeChildrenMap::Node) + sizeof(NodeNotifyMap::Node)))/1024/1024/1024);
-    sn_pool.init_global(mempool_size);
-    ntf_pool.init_global(mempool_size);
-    ns_pool.init_global(mempool_size);
-    nc_pool.init_global(mempool_size);
-    nn_pool.init_global(mempool_size);
+    lm_states = nullptr; // created with the model below
+    // Pools grow on demand, pool_reserve items of each kind are kept between searches.
+    sn_pool.init_global(pool_reserve, thread_num);
+    ntf_pool.init_global(pool_reserve, thread_num);
+    ns_pool.init_global(pool_reserve, thread_num);
+    nc_pool.init_global(pool_reserve, thread_num);
+    seg_pool.init_global(0, thread_num);
+    hc_pool.init_global(0, thread_num);
+    __printf("dagsearch reserving %.2f GB memory on this worker\n", float(pool_allocated_bytes())/1024/1024/1024);
 
     max_pos = maxpos;
 
-    beams = create_and_init<vector<pair<float, SearchNode*>>>(batch_size * maxpos, [&](int i){
-        return new vector<pair<float, SearchNode*>>;
-    });
+    beam_capacity = beam_size;
+    beam_items.resize(batch_size * beam_capacity);
+    beam_count.assign(batch_size, 0);
     int hashsize = beam_size * top_cand_n * maxtoken / batch_size;
-    node_notify_map_atomic = create_and_init<NodeNotifyMap>(batch_size, [&](int i){
-        return new NodeNotifyMap(hashsize, &nn_pool);
-    });
+    step_unit_begin.resize(batch_size + 1);
+    step_dead.assign(maxpos, 0);
+    length_penalty.resize(maxpos + 1);
+    length_penalty_alpha = NAN; // never equal, the first search builds the table
+    length_penalty_mode = LENGTH_PENALTY_POWER;
+    chunk_size = 0;
+    step_lm_vocab = nullptr;
+    init_time = get_time = expand_time = traverse_time = 0;
     node_step_map = create_and_init<NodeStepMap>(batch_size, [&](int i){
         return new NodeStepMap(hashsize, &ns_pool);
     });
@@ -104,6 +131,9 @@ void global_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int
     if(lm_path != nullptr){
         //__printf("loading lm\n");
         model = lm::ngram::LoadVirtual(lm_path, lm::ngram::Config());
+        lm::ngram::ModelType model_type = lm::ngram::PROBING; // what LoadVirtual uses for arpa files
+        lm::ngram::RecognizeBinary(lm_path, model_type);
+        lm_score_pending = select_lm_score_pending(model_type);
         if(model != nullptr){
             //__printf("loading lm successfully\n");
         }else{
@@ -111,77 +141,174 @@ void global_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int
         }
     }else{
         model = nullptr;
+        lm_score_pending = nullptr;
     }
+    // states are shared by all batches
+    int lm_state_hashsize = (int)min((long)hashsize * batch_size, 1L << 21);
+    lm_states = model ? create_lm_state_table(model->Order(), lm_state_hashsize, thread_num) : nullptr;
 
-    #pragma omp parallel
-    {
-        thread_notify_cache.init();
-        thread_expand_cache.init();
+    thread_context = new ThreadContext[thread_num];
+    for(int i = 0; i < thread_num; i++){
+        thread_context[i].notify_cache.init(this, batch_size, maxpos);
+        thread_context[i].expand_cache.init(this, &thread_context[i].lm_cache);
+        thread_context[i].lm_cache.init(model);
     }
 
     //__printf("exit_init\n");
 }
-int query_vocab_index(char* word){
+
+DagSearcher::~DagSearcher()
+{
+    delete_all(node_step_map, max_batch_size);
+    delete_all(node_children_map, max_batch_size);
+    delete lm_states;
+    delete model;
+    delete[] thread_context;
+}
+
+int DagSearcher::nodes_created()
+{
+    int res = 0;
+    for(int i = 0; i < thread_num; i++) res += thread_context[i].expand_cache.nodes_created;
+    return res;
+}
+
+long DagSearcher::lm_cache_hits()
+{
+    long res = 0;
+    for(int i = 0; i < thread_num; i++) res += thread_context[i].lm_cache.hits;
+    return res;
+}
+
+long DagSearcher::lm_cache_lookups()
+{
+    long res = 0;
+    for(int i = 0; i < thread_num; i++) res += thread_context[i].lm_cache.lookups;
+    return res;
+}
+
+int DagSearcher::query_vocab_index(char* word){
     const lm::base::Vocabulary &vocab = model->BaseVocabulary();
     return vocab.Index(word);
 }
 
-inline SearchNode* allocate_node(SearchNode* parent, int word, int lm_word)  // may be called parallelly
+template<class Model>
+float LMTransitionCache::score(DagSearcher* searcher, const Model* model, int in_state, lm::WordIndex word, int &out_state)
 {
-    SearchNode* now = sn_pool.allocate();
-    #ifdef DEBUG
-    if (now - sn_pool.pool >= ntf_pool.pool_size) printf("node memory exceeded!!!!!\n\n");
-    #endif
+    lookups++;
+    Entry &entry = this->entry(in_state, word);
+    if(entry.in_state == in_state && entry.word == word){
+        hits++;
+    }else{
+        lm::ngram::State state, next_state;
+        searcher->lm_state(in_state, state);
+        entry.in_state = in_state;
+        entry.word = word;
+        entry.score = lm_full_score(model, state, word, next_state);
+        entry.out_state = searcher->intern_lm_state(next_state);
+    }
+    out_state = entry.out_state;
+    return entry.score;
+}
+
+// Scoring all the nodes of a step together lets the cache entries of the next nodes be prefetched, so their misses
+// overlap instead of stalling one node at a time. Repeated (state, word) pairs of the step hit the entry of the first one.
+template<class Model>
+void LMTransitionCache::score_pending(DagSearcher* searcher, const Model* model)
+{
+    size_t n = pending.size();
+    for(size_t i = 0; i < n; i++){
+        if(i + prefetch_distance < n){
+            const Pending &ahead = pending[i + prefetch_distance];
+            __builtin_prefetch(&entry(ahead.node->parent->lm_state, ahead.word));
+        }
+        SearchNode* node = pending[i].node;
+        node->lmscore = node->parent->lmscore + score(searcher, model, node->parent->lm_state, pending[i].word, node->lm_state);
+    }
+    pending.clear();
+}
+
+inline SearchNode* DagSearcher::allocate_node(SearchNode* parent, int word, int lm_word, LMTransitionCache* lm_cache)  // may be called parallelly
+{
+    int id;
+    SearchNode* now = sn_pool.allocate(id);
+    SearchNodeState &state = *node_states.get_or_create(id);
     now->parent = parent;
     now->word = word;
+    now->id = id;
     now->dagscore = -INFINITY;
-    now->dagstepscore_map.clear();
+    state.dagstepscore_map.clear();
+    state.history = nullptr;
 
+    now->lm_state = 0;
     if(parent == nullptr){
         now->length = 0;
-        if(model) model->BeginSentenceWrite(&now->lm_state);
+        if(model){
+            lm::ngram::State begin_state;
+            model->BeginSentenceWrite(&begin_state);
+            now->lm_state = intern_lm_state(begin_state);
+        }
         now->lmscore = 0;
     }else{
         now->length = parent->length + 1;
-        if(model) now->lmscore = parent->lmscore + model->BaseScore(&parent->lm_state, lm_word, &now->lm_state);
-        else now->lmscore = 0;
+        now->lmscore = 0;
+        if(model) lm_cache->defer(now, lm_word); // scored at the end of expand_beam_body
     }
     return now;
 }
 
-inline void insert_notify(int batch, SearchNode* target, int pos, int length)  // may be called parallelly
+// Called when node is expanded. Its parent was expanded in an earlier step, so the parent's history is complete,
+// and siblings expanded by other threads race only for the next slot of the shared chunk.
+inline void DagSearcher::build_history(SearchNode* node)
+{
+    SearchNodeState &state = node_state(node);
+    if(state.history) return;
+    HistoryChunk* chunk = node->parent ? node_state(node->parent).history : nullptr;
+    int offset = chunk ? node->length - chunk->begin : HistoryChunk::size;
+    int expected = offset;
+    if(offset < HistoryChunk::size && chunk->used.compare_exchange_strong(expected, offset + 1)){
+        chunk->words[offset] = node->word;
+    }else{
+        HistoryChunk* fresh = hc_pool.allocate();
+        if(offset < HistoryChunk::size){ // a sibling owns the slot, copy the shared prefix
+            fresh->prev = chunk->prev;
+            fresh->begin = chunk->begin;
+            memcpy(fresh->words, chunk->words, offset * sizeof(int));
+        }else{
+            fresh->prev = chunk;
+            fresh->begin = node->length;
+            offset = 0;
+        }
+        fresh->words[offset] = node->word;
+        fresh->used.store(offset + 1, std::memory_order_relaxed);
+        chunk = fresh;
+    }
+    state.history = chunk;
+}
+
+inline void DagSearcher::insert_notify(ThreadContext &ctx, int batch, SearchNode* target, int pos, int length)  // may be called parallelly
 {
     Notify* now = ntf_pool.allocate();
-    #ifdef DEBUG
-    if (now - ntf_pool.pool >= ntf_pool.pool_size) printf("notify memory exceeded!!!!!\n\n");
-    #endif
     now->target = target;
-    auto& tar = (*thread_notify_cache.local_head)[make_pair(batch, make_pair(pos, length))];
-    now->next = tar.first;
-    tar.first = now;
-    if(tar.second == nullptr) tar.second = now;
+    Notify* &head = ctx.notify_cache.local_head(batch, pos, length);
+    now->next = head;
+    head = now;
 }
 
-inline void direct_insert_notify(int batch, SearchNode* target, int pos, int length)
+inline void DagSearcher::direct_insert_notify(ThreadContext &ctx, int batch, SearchNode* target, int pos, int length)
 {
     Notify* now = ntf_pool.allocate();
-        #ifdef DEBUG
-    if (now - ntf_pool.pool >= ntf_pool.pool_size) printf("notify memory exceeded!!!!!\n\n");
-    #endif
     now->target = target;
-    bool create;
-    now->next = node_notify_map_atomic[batch]->get_or_create(make_pair(pos, length), create, memory_order_relaxed).
-                                               exchange(now, memory_order_relaxed);  //TODO: heat point
-
-    if(create) now->next = nullptr;
+    now->next = nullptr;
+    ctx.notify_cache.push_segment(batch, pos, length, now);
 }
 
-inline void add_step_dagscore(int batch, SearchNode* nextnode, int nextstep, float dagscore){
+inline void DagSearcher::add_step_dagscore(ThreadContext &ctx, int batch, SearchNode* nextnode, int nextstep, float dagscore){
     bool create;
     // __printf("add_step_dagscore enter\n");
-    float& target_dagscore = nextnode->dagstepscore_map.get_or_create(nextstep, create, batch, nextnode);
+    float& target_dagscore = node_state(nextnode).dagstepscore_map.get_or_create(nextstep, create, node_step_map[batch], nextnode);
     if(create){ //write to notify if it's a new node for nextstep
-        insert_notify(batch, nextnode, nextstep, nextnode->length);
+        insert_notify(ctx, batch, nextnode, nextstep, nextnode->length);
         target_dagscore = dagscore;
     }else{
         target_dagscore = logaddexp(target_dagscore, dagscore);
@@ -189,46 +316,67 @@ inline void add_step_dagscore(int batch, SearchNode* nextnode, int nextstep, flo
     // __printf("add_step_dagscore exit\n");
 }
 
-void init_start_node(int batch, int go_id)
+void DagSearcher::init_start_node(ThreadContext &ctx, int batch, int go_id)
 {
     // __printf("init_start_node batch_id=%d\n", batch);
-    SearchNode* node = allocate_node(nullptr, go_id, 0);
+    SearchNode* node = allocate_node(nullptr, go_id, 0, nullptr);
     // __printf("init_start_node after allocate node\n", batch);
     node->dagscore = 0;
-    direct_insert_notify(batch, node, 0, 0);
+    direct_insert_notify(ctx, batch, node, 0, 0);
     // __printf("init_start_node after notify\n", batch);
     bool create;
-    float &dagscore = node->dagstepscore_map.get_or_create(0, create, batch, node);
+    float &dagscore = node_state(node).dagstepscore_map.get_or_create(0, create, node_step_map[batch], node);
     dagscore = 0;
     // __printf("init_start_node after insert node_step_map batch=%d\n", batch);
 }
 
-void init_beam(int batch_size, int go_id)
+void DagSearcher::init_beam_body(int batch_size, int go_id)
 {
-    assert(batch_size <= max_batch_size);
-    #ifdef QUICKMAP_DEBUG
-    QuickMap<int, float, SearchNode::QuickMapSize, dagstep_get_or_create>::show();
-    #endif
-    sn_pool.clear_global();
-    ntf_pool.clear_global();
-    ns_pool.clear_global();
-    nc_pool.clear_global();
-    nn_pool.clear_global();
-    #pragma omp parallel
+    #pragma omp single
     {
-        sn_pool.clear_thread();
-        ntf_pool.clear_thread();
-        ns_pool.clear_thread();
-        nc_pool.clear_thread();
-        nn_pool.clear_thread();
-        #pragma omp for schedule(static) nowait
-        for(int batch = 0; batch < batch_size; batch++){
-            node_step_map[batch]->clear(); //hot
-            node_children_map[batch]->clear(); //hot
-            node_notify_map_atomic[batch]->clear();
-            init_start_node(batch, go_id);
+        assert(batch_size <= max_batch_size);
+        #ifdef QUICKMAP_DEBUG
+        QuickMap<int, float, SearchNodeState::QuickMapSize, dagstep_get_or_create>::show();
+        #endif
+        node_states.release_from(sn_pool.clear_global());
+        ntf_pool.clear_global();
+        ns_pool.clear_global();
+        nc_pool.clear_global();
+        if(lm_states) lm_states->clear_global();
+        seg_pool.clear_global();
+        hc_pool.clear_global();
+        // Every context is reset, not only those of this team: get_beam reads the notify segments of all of them, and
+        // a search started from another thread may run with fewer threads than the previous one.
+        for(int t = 0; t < thread_num; t++){
+            ThreadContext &other = thread_context[t];
+            fill(other.notify_cache.segments.begin(), other.notify_cache.segments.begin() + batch_size * max_pos, nullptr);
+            other.expand_cache.nodes_created = 0;
+            other.lm_cache.hits = other.lm_cache.lookups = 0;
         }
     }
+
+    ThreadContext &ctx = thread_context[omp_get_thread_num()];
+    ctx.lm_cache.clear();
+    sn_pool.clear_thread();
+    ntf_pool.clear_thread();
+    ns_pool.clear_thread();
+    nc_pool.clear_thread();
+    if(lm_states) lm_states->clear_thread();
+    seg_pool.clear_thread();
+    hc_pool.clear_thread();
+    #pragma omp for schedule(static)
+    for(int batch = 0; batch < batch_size; batch++){
+        node_step_map[batch]->clear(); //hot
+        node_children_map[batch]->clear(); //hot
+        init_start_node(ctx, batch, go_id);
+    }
+}
+
+void DagSearcher::init_beam(int batch_size, int go_id)
+{
+    request_full_team();
+    #pragma omp parallel num_threads(thread_num)
+    init_beam_body(batch_size, go_id);
 }
 
 
@@ -240,10 +388,13 @@ SearchNode* ExpandBeamCache::load(int batch, SearchNode* node, int nextword, int
     search_node = node; search_nextword = nextword;
     bool create;
     // __printf("cache load before query hash\n");
-    SearchNode* &new_node = node_children_map[batch]->
+    SearchNode* &new_node = searcher->node_children_map[batch]->
             get_or_create(make_pair(node, nextword), create, memory_order_relaxed);
     // __printf("cache load after query hash\n");
-    if(create) new_node = allocate_node(node, nextword, lm_word);
+    if(create){
+        new_node = searcher->allocate_node(node, nextword, lm_word, lm_cache);
+        nodes_created++;
+    }
     cached_nextnode = new_node;
     cached_add_score = -INFINITY;
     // __printf("cache load cached_nextnode=%p\n", cached_nextnode);
@@ -260,45 +411,247 @@ void ExpandBeamCache::write_back()
     search_node = nullptr;
 }
 
+void NotifyCache::push_segment(int batch, int pos, int length, Notify* head)
+{
+    NotifySegment* now = searcher->seg_pool.allocate();
+    now->batch = batch;
+    now->length = length;
+    now->head = head;
+    NotifySegment* &segment_head = segments[batch * searcher->max_pos + pos];
+    now->next = segment_head;
+    segment_head = now;
+}
+
+void NotifyCache::grow()
+{
+    vector<Entry> old_table;
+    old_table.swap(table);
+    table.assign(old_table.size() * 2, Entry{0, 0, 0, 0, nullptr});
+    size_t mask = table.size() - 1;
+    for(int &slot : used){
+        const Entry &entry = old_table[slot];
+        size_t idx = hash(entry.batch, entry.pos, entry.length) & mask;
+        while(table[idx].version == version) idx = (idx + 1) & mask;
+        table[idx] = entry;
+        slot = idx;
+    }
+}
+
 void NotifyCache::write_back()
 {
-    bool create;
-    // printf("localhead: %p\n", local_head);
-    for(auto &item : (*local_head)){
-        int batch = item.first.first;
-        Notify* now_head = item.second.first;
-        Notify* now_tail = item.second.second;
-        now_tail->next = node_notify_map_atomic[batch]->get_or_create(item.first.second, create, memory_order_relaxed).
-                                                exchange(now_head, memory_order_relaxed);  //TODO: heat point
-        if(create) now_tail->next = nullptr;
+    // Each (batch, pos, length) written in this expand_beam becomes a new segment of this thread,
+    // a bucket may consist of several segments from different threads and steps.
+    for(int slot : used){
+        const Entry &entry = table[slot];
+        push_segment(entry.batch, entry.pos, entry.length, entry.head);
+    }
+    used.clear();
+    if(++version == 0){ // wrapped around, old entries could look current
+        for(auto &entry : table) entry.version = 0;
+        version = 1;
     }
-    local_head->clear();
 }
 
-class ChunkManager{
-public:
-    vector<int> chk_arr;
+uint64_t RepeatBlocker::power(int n)
+{
+    if(base_pow.empty()) base_pow.push_back(1);
+    while((int)base_pow.size() <= n) base_pow.push_back(base_pow.back() * hash_base);
+    return base_pow[n];
+}
 
-    int prepare_chunk(int batch_size, int step, __Pyx_memviewslice output_length){
-        int sum = 0;
-        chk_arr.reserve(batch_size);
-        for(int i = 0; i < batch_size; i++){
-            chk_arr.push_back(sum);
-            if(step < (*((int*)(output_length.data) + i) - 1)) sum += beams[i * max_pos]->size();
+bool RepeatBlocker::same_ngram(int end1, int end2, int n)
+{
+    if(end1 - n + 1 < 0 || end2 - n + 1 < 0) return false;
+    uint64_t pow_n = power(n);
+    if(ngram_hash(end1, n, pow_n) != ngram_hash(end2, n, pow_n)) return false;
+    for(int k = 0; k < n; k++) if(words[end1 - k] != words[end2 - k]) return false; // rule out hash collisions
+    return true;
+}
+
+void RepeatBlocker::mark(const HistoryChunk* history, int len, const ExpandCandidate* cands, int cand_n, int no_consecutive_repeat_ngram, int no_repeat_ngram)
+{
+    banned.assign(cand_n, 0);
+    if((int)words.size() <= len){
+        words.resize(len + 1);
+        prefix_hash.resize(len + 1);
+    }
+    // no_consecutive_repeat_ngram alone only looks at the last 2 * no_consecutive_repeat_ngram words
+    int first = no_repeat_ngram > 0 ? 0 : max(0, len - 2 * no_consecutive_repeat_ngram - 2);
+    int end = len + 1;
+    for(const HistoryChunk* chunk = history; end > first; chunk = chunk->prev){
+        memcpy(words.data() + chunk->begin, chunk->words, (end - chunk->begin) * sizeof(int));
+        end = chunk->begin;
+    }
+    uint64_t hash = 0;
+    for(int i = first; i <= len; i++) prefix_hash[i] = hash = extend_hash(hash, words[i]);
+
+    // An earlier position prev matching the end of the hypothesis bans the word that followed prev.
+    if(no_consecutive_repeat_ngram > 0){
+        ban(words[len], cands, cand_n);
+        for(int dist = 1; dist <= min(no_consecutive_repeat_ngram, len); dist++){
+            int prev = len - dist;
+            // the dist-gram ending at len would be repeated right after itself
+            if(words[prev] == words[len] && same_ngram(prev, len, max(dist - 1, 1))) ban(words[prev + 1], cands, cand_n);
         }
-        #ifdef DEBUG
-            printf("prepare_chunk: sum=%d\n", sum);
-        #endif
-        return sum;
     }
+    if(no_repeat_ngram == 1){
+        for(int prev = 0; prev < len; prev++)
+            if(words[prev] == words[len]) ban(words[prev + 1], cands, cand_n);
+    }else if(no_repeat_ngram > 1){
+        int n = no_repeat_ngram - 1;
+        if(n > len) return;
+        uint64_t pow_n = power(n);
+        uint64_t target = ngram_hash(len, n, pow_n);
+        for(int prev = n - 1; prev < len; prev++){
+            if(ngram_hash(prev, n, pow_n) == target && same_ngram(prev, len, n)) ban(words[prev + 1], cands, cand_n);
+        }
+    }
+}
+
+void DagSearcher::prepare_chunk(int batch_size, int step, const int* output_length_data)
+{
+    int sum = 0;
+    chunk_begin.clear();
+    for(int i = 0; i < batch_size; i++){
+        chunk_begin.push_back(sum);
+        if(step < output_length_data[i] - 1) sum += beam_count[i];
+    }
+    chunk_begin.push_back(sum);
+    #ifdef DEBUG
+        printf("prepare_chunk: sum=%d\n", sum);
+    #endif
+    chunk_size = sum;
+}
+
+// Beams are handed out in units of about the same cost (the candidates a beam visits plus a fixed overhead), which the
+// threads take in turn. With equal numbers of beams per thread, batches with long candidate lists or sentences that are
+// still going kept a few threads busy while the others waited at the barrier.
+void DagSearcher::prepare_work_units(int batch_size, bool repeat_blocking)
+{
+    const vector<int> &beam_cands = repeat_blocking ? step_cand_count : step_cutoff;
+    double total = 0;
+    for(int batch = 0; batch < batch_size; batch++){
+        int beams = chunk_begin[batch + 1] - chunk_begin[batch];
+        if(beams) total += beams * (double)(work_beam_overhead + beam_cands[batch]);
+    }
+    double target = max((double)work_unit_min_cost, total / (thread_num * work_units_per_thread));
+    work_units.clear();
+    WorkUnit unit = {0, 0, 0};
+    double cost = 0;
+    for(int batch = 0; batch < batch_size; batch++){
+        int beam_cost = work_beam_overhead + beam_cands[batch];
+        for(int i = chunk_begin[batch]; i < chunk_begin[batch + 1]; i++){
+            if(unit.begin == unit.end) unit = {batch, i, i};
+            unit.end = i + 1;
+            cost += beam_cost;
+            if(cost >= target){
+                work_units.push_back(unit);
+                unit.begin = unit.end;
+                cost = 0;
+            }
+        }
+    }
+    if(unit.begin != unit.end) work_units.push_back(unit);
+}
+
+// The candidates of a row do not depend on the beam, so their data is gathered and exp() taken once per step
+// instead of once per expanded beam.
+// Batches with no beam to expand (dead or finished) are skipped, their rows may hold padding past the output length.
+template<>
+void DagSearcher::prepare_candidates(int batch_size, int step,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            float top_p,
+            int score_dtype)
+{
+    int top_cand_n = dagscores.shape[2];
+    cand_stride = top_cand_n;
+    step_candidates.resize(batch_size * cand_stride);
+    step_cand_count.resize(batch_size);
+    step_cutoff.resize(batch_size);
+    const int* lm_vocab_data = (int*)lm_vocab.data;
+    step_lm_vocab = lm_vocab_data;
+    for(int batch = 0; batch < batch_size; batch++){
+        if(chunk_begin[batch + 1] == chunk_begin[batch]) continue;
+        const char* row_scores = dagscores.data + batch * dagscores.strides[0] + step * dagscores.strides[1];
+        const char* row_nextsteps = nextstep_idx.data + batch * nextstep_idx.strides[0] + step * nextstep_idx.strides[1];
+        const char* row_words = logits_idx.data + batch * logits_idx.strides[0] + step * logits_idx.strides[1];
+        fill_candidates(batch, top_cand_n, score_dtype, row_scores, dagscores.strides[2], row_nextsteps, nextstep_idx.strides[2],
+            row_words, logits_idx.strides[2], lm_vocab_data, top_p);
+    }
+}
+
+// Rows have their own lengths, cand_stride is the longest row of the step among the batches that still expand.
+template<>
+void DagSearcher::prepare_candidates_csr(int batch_size, int step, int prelen,
+            __Pyx_memviewslice row_offsets,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            float top_p,
+            int score_dtype)
+{
+    const int* offsets = (int*)row_offsets.data;
+    cand_stride = 0;
+    for(int batch = 0; batch < batch_size; batch++){
+        if(chunk_begin[batch + 1] == chunk_begin[batch]) continue;
+        int row = batch * prelen + step;
+        cand_stride = max(cand_stride, offsets[row + 1] - offsets[row]);
+    }
+    if((int)step_candidates.size() < batch_size * cand_stride) step_candidates.resize(batch_size * cand_stride);
+    step_cand_count.resize(batch_size);
+    step_cutoff.resize(batch_size);
+    const int* lm_vocab_data = (int*)lm_vocab.data;
+    step_lm_vocab = lm_vocab_data;
+    for(int batch = 0; batch < batch_size; batch++){
+        if(chunk_begin[batch + 1] == chunk_begin[batch]) continue;
+        int row = batch * prelen + step;
+        int begin = offsets[row];
+        fill_candidates(batch, offsets[row + 1] - begin, score_dtype, dagscores.data + begin * dagscores.strides[0], dagscores.strides[0],
+            nextstep_idx.data + begin * nextstep_idx.strides[0], nextstep_idx.strides[0],
+            logits_idx.data + begin * logits_idx.strides[0], logits_idx.strides[0], lm_vocab_data, top_p);
+    }
+}
 
-    tuple<int, int> get(int i) const {
-        int pos = upper_bound(chk_arr.begin(), chk_arr.end(), i) - chk_arr.begin() - 1;
-        return {pos, i - chk_arr[pos]};
+// 16-bit scores are widened here, once per candidate and step, the search only sees floats.
+// The rows are read through their byte strides, so views of larger tensors (a slice of the candidates, a transposed
+// layout) are used without copying them first.
+void DagSearcher::fill_candidates(int batch, int cand_n, int score_dtype, const char* scores, ptrdiff_t score_stride,
+            const char* nextsteps, ptrdiff_t nextstep_stride, const char* words, ptrdiff_t word_stride, const int* lm_vocab_data, float top_p)
+{
+    switch(score_dtype){
+        case SCORE_FLOAT16: fill_candidates<Half>(batch, cand_n, scores, score_stride, nextsteps, nextstep_stride, words, word_stride, lm_vocab_data, top_p); break;
+        case SCORE_BFLOAT16: fill_candidates<BFloat16>(batch, cand_n, scores, score_stride, nextsteps, nextstep_stride, words, word_stride, lm_vocab_data, top_p); break;
+        default: fill_candidates<float>(batch, cand_n, scores, score_stride, nextsteps, nextstep_stride, words, word_stride, lm_vocab_data, top_p);
     }
-};
+}
 
-inline void expand_path(int batch, SearchNode* node, int nextstep, int word, int lm_word, float dagscore)
+template<class S>
+void DagSearcher::fill_candidates(int batch, int cand_n, const char* scores, ptrdiff_t score_stride,
+            const char* nextsteps, ptrdiff_t nextstep_stride, const char* words, ptrdiff_t word_stride, const int* lm_vocab_data, float top_p)
+{
+    ExpandCandidate* cands = &step_candidates[batch * cand_stride];
+    float count_sum = 0;
+    int cutoff = cand_n;
+    for(int j = 0; j < cand_n; j++){
+        ExpandCandidate &cand = cands[j];
+        cand.word = *(const int*)(words + j * word_stride);
+        cand.nextstep = *(const int*)(nextsteps + j * nextstep_stride);
+        cand.score = to_float(*(const S*)(scores + j * score_stride));
+        cand.prob = exp(cand.score);
+        if(!(count_sum < top_p) && cutoff == cand_n) cutoff = j;
+        count_sum += cand.prob;
+        // Words past the cutoff may be padding outside lm_vocab, they are only looked up if repeat blocking expands them.
+        cand.lm_word = cutoff == cand_n ? lm_vocab_data[cand.word] : -1;
+    }
+    step_cand_count[batch] = cand_n;
+    step_cutoff[batch] = cutoff;
+}
+
+inline void DagSearcher::expand_path(ThreadContext &ctx, int batch, SearchNode* node, int nextstep, int word, int lm_word, float dagscore)
 {
     #ifdef DEBUG
     printf("expand_path batch=%d now=[", batch);
@@ -306,13 +659,13 @@ inline void expand_path(int batch, SearchNode* node, int nextstep, int word, int
     printf("] nextstep=%d nextword=%d dagscore=%f\n", nextstep, word, dagscore);
     #endif
 
-    SearchNode* nextnode_readonly = thread_expand_cache.load(batch, node, word, lm_word);
-    thread_expand_cache.addscore(dagscore);
-    add_step_dagscore(batch, nextnode_readonly, nextstep, dagscore);
+    SearchNode* nextnode_readonly = ctx.expand_cache.load(batch, node, word, lm_word);
+    ctx.expand_cache.addscore(dagscore);
+    add_step_dagscore(ctx, batch, nextnode_readonly, nextstep, dagscore);
 }
 
 template<>
-void expand_beam(int batch_size, int step,
+void DagSearcher::expand_beam_body(int batch_size, int step,
             __Pyx_memviewslice output_length,
             __Pyx_memviewslice dagscores,
             __Pyx_memviewslice nextstep_idx,
@@ -320,89 +673,443 @@ void expand_beam(int batch_size, int step,
             __Pyx_memviewslice lm_vocab,
             float top_p,
             int no_consecutive_repeat_ngram,
-            int no_repeat_ngram) {
+            int no_repeat_ngram,
+            int score_dtype) {
 
-    int top_cand_n = dagscores.shape[2];
+    #pragma omp single
+    {
+        prepare_chunk(batch_size, step, (int*)output_length.data);
+        prepare_candidates(batch_size, step, dagscores, nextstep_idx, logits_idx, lm_vocab, top_p, score_dtype);
+        prepare_work_units(batch_size, no_consecutive_repeat_ngram > 0 || no_repeat_ngram > 0);
+    }
+    expand_candidates(step, top_p, no_consecutive_repeat_ngram, no_repeat_ngram);
+}
 
-    ChunkManager chunk_manager;
-    int chunk_size = chunk_manager.prepare_chunk(batch_size, step, output_length);
+template<>
+void DagSearcher::expand_beam_csr_body(int batch_size, int step, int prelen,
+            __Pyx_memviewslice output_length,
+            __Pyx_memviewslice row_offsets,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            float top_p,
+            int no_consecutive_repeat_ngram,
+            int no_repeat_ngram,
+            int score_dtype) {
 
-    #pragma omp parallel
+    #pragma omp single
     {
-        #pragma omp for schedule(static) nowait
-        for(int i = 0; i < chunk_size; i++){
-            int now_batch, now_beam;
-            std::tie(now_batch, now_beam) = chunk_manager.get(i);
+        prepare_chunk(batch_size, step, (int*)output_length.data);
+        prepare_candidates_csr(batch_size, step, prelen, row_offsets, dagscores, nextstep_idx, logits_idx, lm_vocab, top_p, score_dtype);
+        prepare_work_units(batch_size, no_consecutive_repeat_ngram > 0 || no_repeat_ngram > 0);
+    }
+    expand_candidates(step, top_p, no_consecutive_repeat_ngram, no_repeat_ngram);
+}
+
+inline void DagSearcher::expand_one_beam(ThreadContext &ctx, int step, int now_batch, int now_beam, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram)
+{
+    SearchNode* now_node = beam_items[(size_t)now_batch * beam_capacity + now_beam].second;
+
+    bool create = false;
+    float dagstepscore = node_state(now_node).dagstepscore_map.get_or_create(step, create, node_step_map[now_batch], now_node);
 
-            // tid = omp_get_thread_num();
-            // printf("expand_beam prange start tid=%d chunk=%d now_batch=%d now_beam=%d\n", tid, i, now_batch, now_beam);
-            // __printf("threads num = %d", omp_get_num_threads());
+    #ifdef DEBUG
+    if(create) printf("????????????? bug in expand_beam\n");
+    #endif
 
-            SearchNode* now_node = (*beams[now_batch * max_pos])[now_beam].second;
+    const ExpandCandidate* cands = &step_candidates[now_batch * cand_stride];
+    int cand_n = step_cand_count[now_batch];
+    if(no_consecutive_repeat_ngram > 0 || no_repeat_ngram > 0){
+        build_history(now_node);
+        RepeatBlocker &blocker = ctx.repeat_blocker;
+        blocker.mark(node_state(now_node).history, now_node->length, cands, cand_n, no_consecutive_repeat_ngram, no_repeat_ngram);
+        // banned candidates do not count towards top_p, so the cutoff depends on the beam
+        float count_sum = 0;
+        for(int j = 0; j < cand_n && count_sum < top_p; j++){
+            if(blocker.banned[j]) continue;
+            count_sum += cands[j].prob;
+            int lm_word = cands[j].lm_word >= 0 ? cands[j].lm_word : step_lm_vocab[cands[j].word];
+            expand_path(ctx, now_batch, now_node, cands[j].nextstep, cands[j].word, lm_word, dagstepscore + cands[j].score);
+        }
+    }else{
+        for(int j = 0; j < step_cutoff[now_batch]; j++)
+            expand_path(ctx, now_batch, now_node, cands[j].nextstep, cands[j].word, cands[j].lm_word, dagstepscore + cands[j].score);
+    }
+}
+
+void DagSearcher::expand_candidates(int step, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram)
+{
+    {
+        ThreadContext &ctx = thread_context[omp_get_thread_num()];
+        #pragma omp for schedule(dynamic) nowait
+        for(int u = 0; u < (int)work_units.size(); u++){
+            const WorkUnit &unit = work_units[u];
+            int now_batch = unit.batch;
+            for(int i = unit.begin; i < unit.end; i++){
+                while(i >= chunk_begin[now_batch + 1]) now_batch++;
+                expand_one_beam(ctx, step, now_batch, i - chunk_begin[now_batch], top_p, no_consecutive_repeat_ngram, no_repeat_ngram);
+            }
+        }
 
-            bool create = false;
-            float dagstepscore = now_node->dagstepscore_map.get_or_create(step, create, now_batch, now_node);
+        if(model) lm_score_pending(ctx.lm_cache, this);
+        ctx.expand_cache.write_back();
+        ctx.notify_cache.write_back();
+    }
+    #pragma omp barrier
+}
 
-            #ifdef DEBUG
-            if(create) printf("????????????? bug in expand_beam\n");
-            #endif
+template<>
+void DagSearcher::expand_beam(int batch_size, int step,
+            __Pyx_memviewslice output_length,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            float top_p,
+            int no_consecutive_repeat_ngram,
+            int no_repeat_ngram,
+            int score_dtype) {
+
+    request_full_team();
+    #pragma omp parallel num_threads(thread_num)
+    expand_beam_body(batch_size, step, output_length, dagscores, nextstep_idx, logits_idx, lm_vocab, top_p, no_consecutive_repeat_ngram, no_repeat_ngram, score_dtype);
+}
+
+void DagSearcher::recombine_beam(ThreadContext &ctx, vector<pair<float, SearchNode*>> &beam, int batch, int step, int recombine, float gamma)
+{
+    // All nodes in beam have the same length and are at the same step, merge those with the same lm_state.
+    vector<RecombineItem> &items = ctx.recombine_buf;
+    items.clear();
+    for(auto &item : beam) items.push_back({item.second->lm_state, item.first, item.second});
+    sort(items.begin(), items.end());
+
+    beam.clear();
+    SearchNode* survivor = nullptr; // best node of the current group
+    for(size_t k = 0; k < items.size(); k++){
+        SearchNode* node = items[k].node;
+        if(k == 0 || items[k].lm_state != items[k - 1].lm_state){
+            survivor = node;
+            beam.push_back(make_pair(items[k].score, node));
+            continue;
+        }
+        // merged into survivor, which has a higher score
+        if(recombine == RECOMBINE_LOGSUMEXP){
+            bool create;
+            float &survivor_stepscore = node_state(survivor).dagstepscore_map.get_or_create(step, create, node_step_map[batch], survivor);
+            float node_stepscore = node_state(node).dagstepscore_map.get_or_create(step, create, node_step_map[batch], node);
+            survivor_stepscore = logaddexp(survivor_stepscore, node_stepscore);
+            survivor->dagscore = logaddexp(survivor->dagscore, node_stepscore);
+        }
+    }
+    if(recombine == RECOMBINE_LOGSUMEXP){
+        for(auto &item : beam) item.first = calculate_score(item.second, gamma, length_penalty.data());
+    }
+}
+
+// The penalties of all lengths a node can have, so that scoring a node in get_beam needs no pow.
+void DagSearcher::prepare_length_penalty(float alpha, int mode)
+{
+    if(alpha == length_penalty_alpha && mode == length_penalty_mode) return;
+    length_penalty_alpha = alpha;
+    length_penalty_mode = mode;
+    for(int length = 0; length <= max_pos; length++){
+        if(mode == LENGTH_PENALTY_GNMT) length_penalty[length] = pow((5 + length) / 6.0, alpha);
+        else length_penalty[length] = pow(length, alpha);
+    }
+}
+
+int DagSearcher::tournament_select(ThreadContext &ctx, int unit_stride, int unit_begin, int unit_end, int beam_size, BeamItem* beam)
+{
+    // Every unit becomes a max-heap, the tops of all units compete in a heap of heads.
+    vector<pair<float, int>> &heads = ctx.merge_heads; // (top score, unit)
+    heads.clear();
+    for(int u = unit_begin; u < unit_end; u++){
+        if(unit_count[u] == 0) continue;
+        BeamItem* unit = unit_items.data() + (size_t)u * unit_stride;
+        make_heap(unit, unit + unit_count[u], BeamItemWorse());
+        heads.push_back(make_pair(unit[0].first, u));
+    }
+    auto head_worse = [](const pair<float, int> &a, const pair<float, int> &b){ return a.first < b.first; };
+    make_heap(heads.begin(), heads.end(), head_worse);
+    int count = 0;
+    while(count < beam_size && !heads.empty()){
+        pop_heap(heads.begin(), heads.end(), head_worse);
+        int winner = heads.back().second;
+        BeamItem* unit = unit_items.data() + (size_t)winner * unit_stride;
+        beam[count++] = unit[0];
+        pop_heap(unit, unit + unit_count[winner], BeamItemWorse());
+        if(--unit_count[winner] > 0){
+            heads.back().first = unit[0].first;
+            push_heap(heads.begin(), heads.end(), head_worse);
+        }else{
+            heads.pop_back();
+        }
+    }
+    return count;
+}
+
+template<>
+void DagSearcher::get_beam_body(int batch_size, int step,
+            __Pyx_memviewslice output_length,
+            float gamma, int beam_size, int beamlensize, int recombine) {
+
+    const int* output_length_data = (int*)output_length.data;
+    const double* length_penalty_data = length_penalty.data();
+    if(model == nullptr) recombine = RECOMBINE_NONE; // there is no lm_state to compare
+    int max_unit_size = 2 * max(beamlensize, 1);
 
-            const int banned_words_max = 128;
-            int banned_words_idx = 0;
-            int banned_words[banned_words_max] = {0};
-            if(no_consecutive_repeat_ngram || no_repeat_ngram){
-                int last_token = now_node->word;
-                if(no_consecutive_repeat_ngram > 0){
-                    banned_words[banned_words_idx++] = last_token;
+    #pragma omp single
+    {
+        // collect the notify segments of all threads at this step, and group them into buckets (batch_id=i, length=j)
+        step_segments.clear();
+        step_units.clear();
+        for(int i = 0; i < batch_size; i++){
+            step_unit_begin[i] = step_units.size();
+            if(step >= output_length_data[i]) continue;
+            int begin = step_segments.size();
+            for(int t = 0; t < thread_num; t++){
+                for(NotifySegment* segment = thread_context[t].notify_cache.segments[i * max_pos + step]; segment; segment = segment->next){
+                    step_segments.push_back(segment);
                 }
-                int dist = 1;
-                for(SearchNode* prevEnd = now_node->parent; prevEnd; last_token = prevEnd->word, prevEnd = prevEnd->parent){
-                    if (prevEnd->word == now_node->word){
-                        int max_match_length = 1;
-                        SearchNode *nowpoint = now_node->parent, *prevpoint = prevEnd->parent;
-                        for(; prevpoint && nowpoint;
-                                    nowpoint = nowpoint->parent, prevpoint = prevpoint->parent){
-                            if(nowpoint->word == prevpoint->word){
-                                max_match_length++;
-                            }else{
-                                break;
-                            }
-                        }
+            }
+            stable_sort(step_segments.begin() + begin, step_segments.end(),
+                [](const NotifySegment* a, const NotifySegment* b){ return a->length < b->length; });
+            for(int k = begin; k < (int)step_segments.size(); k++){
+                if(k == begin || step_segments[k]->length != step_segments[k - 1]->length) step_units.push_back(k);
+            }
+        }
+        step_unit_begin[batch_size] = step_units.size();
+        step_units.push_back(step_segments.size());
 
-                        if(no_consecutive_repeat_ngram >= dist && max_match_length + 1 >= dist){
-                            banned_words[banned_words_idx++] = last_token;
-                            if (banned_words_idx >= banned_words_max) goto banned_full;
-                        }
-                        if(no_repeat_ngram > 0 && no_repeat_ngram <= max_match_length + 1){
-                            banned_words[banned_words_idx++] = last_token;
-                            if (banned_words_idx >= banned_words_max) goto banned_full;
+        // Preallocated beam storage, only reallocated if a search asks for larger beams than before.
+        if((int)unit_items.size() < step_unit_begin[batch_size] * max_unit_size) unit_items.resize(step_unit_begin[batch_size] * max_unit_size);
+        if((int)unit_count.size() < step_unit_begin[batch_size]) unit_count.resize(step_unit_begin[batch_size]);
+        if(beam_size > beam_capacity){
+            beam_capacity = beam_size;
+            beam_items.resize(max_batch_size * beam_capacity);
+        }
+
+        // No notify reaches this step in any batch, there is nothing to select or expand.
+        step_dead[step] = step_segments.empty();
+        if(step_dead[step]){
+            for(int i = 0; i < batch_size; i++) if(step < output_length_data[i]) beam_count[i] = 0;
+        }
+    }
+    if(step_dead[step]) return;
+
+    {
+        ThreadContext &ctx = thread_context[omp_get_thread_num()];
+        // step1: find all first beamlensize at (batch_id=i, length=j), selected while walking the notifies
+        #pragma omp for schedule(guided)
+        for(int u = 0; u < step_unit_begin[batch_size]; u++){
+            int i = step_segments[step_units[u]]->batch;
+
+            int now_beam_size = step == output_length_data[i] - 1 ? 1 : beamlensize;
+            TopKBuffer topk;
+            topk.init(unit_items.data() + (size_t)u * max_unit_size, now_beam_size);
+
+            if(recombine == RECOMBINE_NONE){
+                // Scores are computed for a chunk before any is compared with the threshold: a branch on every fresh
+                // score mispredicts and stalls the cache misses of the notify walk.
+                BeamItem chunk[score_chunk_size];
+                int chunk_len = 0;
+                for(int k = step_units[u]; k < step_units[u + 1]; k++){
+                    for(Notify* root = step_segments[k]->head; root; root = root->next){
+                        chunk[chunk_len++] = make_pair(calculate_score(root->target, gamma, length_penalty_data), root->target);
+                        if(chunk_len == score_chunk_size){
+                            for(int c = 0; c < chunk_len; c++) topk.offer(chunk[c]);
+                            chunk_len = 0;
                         }
                     }
-                    dist++;
                 }
-                banned_full:;
+                for(int c = 0; c < chunk_len; c++) topk.offer(chunk[c]);
+            }else{
+                // recombination needs all candidates of the bucket before any is dropped
+                vector<BeamItem> &candidates = ctx.candidate_buf;
+                candidates.clear();
+                for(int k = step_units[u]; k < step_units[u + 1]; k++){
+                    for(Notify* root = step_segments[k]->head; root; root = root->next){
+                        candidates.push_back(make_pair(calculate_score(root->target, gamma, length_penalty_data), root->target));
+                    }
+                }
+                recombine_beam(ctx, candidates, i, step, recombine, gamma);
+                for(auto &item : candidates) topk.offer(item);
             }
+            unit_count[u] = topk.finish();
+        }
+
+        // step2: find beamsize at batch=i among the winners of all lengths
+        #pragma omp for schedule(guided)
+        for(int i = 0; i < batch_size; i++){
+            if(step < output_length_data[i]){
+                int now_beam_size = step == output_length_data[i] - 1 ? 1 : beam_size;
+                BeamItem* beam = beam_items.data() + (size_t)i * beam_capacity;
+                int unit_begin = step_unit_begin[i], unit_end = step_unit_begin[i + 1];
+                int total = 0;
+                for(int u = unit_begin; u < unit_end; u++) total += unit_count[u];
 
-            float count_sum = 0;
-            for(int j = 0; j < top_cand_n; j++){
-                if(count_sum < top_p){
-                    int word = *((int*)(logits_idx.data + now_batch * logits_idx.strides[0] + step * logits_idx.strides[1]) + j);
-                    bool banned_flag = false;
-                    for(int k = 0; k < banned_words_idx; k++) if(banned_words[k] == word) {banned_flag = true; break;}
-                    if(banned_flag) continue;
-
-                    int lm_word = *((int*)(lm_vocab.data) + word);
-                    int nextstep = *((int*)(nextstep_idx.data + now_batch * nextstep_idx.strides[0] + step * nextstep_idx.strides[1]) + j);
-                    float add_dagstepscore = *((float*)(dagscores.data + now_batch * dagscores.strides[0] + step * dagscores.strides[1]) + j);
-                    count_sum += exp(add_dagstepscore);
-                    expand_path(now_batch, now_node, nextstep, word, lm_word, dagstepscore + add_dagstepscore);
+                if(total <= now_beam_size){ // nothing to drop, take all the winners
+                    int count = 0;
+                    for(int u = unit_begin; u < unit_end; u++){
+                        const BeamItem* unit = unit_items.data() + (size_t)u * max_unit_size;
+                        copy(unit, unit + unit_count[u], beam + count);
+                        count += unit_count[u];
+                    }
+                    beam_count[i] = count;
+                }else if(now_beam_size * tournament_ratio <= total){
+                    beam_count[i] = tournament_select(ctx, max_unit_size, unit_begin, unit_end, now_beam_size, beam);
+                }else{ // most winners survive, a selection over all of them is cheaper than a tournament
+                    vector<BeamItem> &candidates = ctx.candidate_buf;
+                    candidates.clear();
+                    for(int u = unit_begin; u < unit_end; u++){
+                        const BeamItem* unit = unit_items.data() + (size_t)u * max_unit_size;
+                        candidates.insert(candidates.end(), unit, unit + unit_count[u]);
+                    }
+                    nth_element(candidates.begin(), candidates.begin() + now_beam_size, candidates.end(), BeamItemBetter());
+                    copy(candidates.begin(), candidates.begin() + now_beam_size, beam);
+                    beam_count[i] = now_beam_size;
                 }
             }
 
-            //printf("expand_beam prange end tid=%d chunk=%d now_batch=%d now_beam=%d\n", tid, i, now_batch, now_beam);
+            #ifdef DEBUG
+            printf("getbeam finished, batch=%d beams:\n", i);
+            for(int k = 0; k < beam_count[i]; k++){
+                const BeamItem &item = beam_items[(size_t)i * beam_capacity + k];
+                printf("\t[");
+                __debug_print_node(item.second);
+                printf("] allscore=%f dagscore=%f lmscore=%f length=%d\n", item.first, item.second->dagscore, item.second->lmscore, item.second->length);
+            }
+            #endif
+        }
+    }
+}
+
+template<>
+void DagSearcher::get_beam(int batch_size, int step,
+            __Pyx_memviewslice output_length,
+            float alpha, float gamma, int beam_size, int beamlensize, int recombine, int length_penalty_mode) {
+
+    prepare_length_penalty(alpha, length_penalty_mode);
+    request_full_team();
+    #pragma omp parallel num_threads(thread_num)
+    get_beam_body(batch_size, step, output_length, gamma, beam_size, beamlensize, recombine);
+}
+
+inline void traverse_beam_single(SearchNode* beam, int* result, int length, int pad_id, int dedup)
+{
+    int pos = length - 1;
+    for(; beam; beam = beam->parent){
+        result[pos--] = beam->word;
+    }
+    int i = 0;
+    pos++;
+    while(pos < length){
+        if(dedup > 0 && i > 0 && result[i - 1] == result[pos]){
+            pos++;
+        }else{
+            result[i++] = result[pos++];
+        }
+    }
+    while(i < length) result[i++] = pad_id;
+}
+
+template<>
+void DagSearcher::traverse_beam_body(int batch_size, int pad_id,
+            __Pyx_memviewslice result,
+            __Pyx_memviewslice score,
+            int dedup) {
+
+    int length = result.shape[1];
+
+    #pragma omp for schedule(guided)
+    for(int i = 0; i < batch_size; i++){
+        const BeamItem &node_pair = beam_items[(size_t)i * beam_capacity];
+        *(float*)(score.data + i * score.strides[0]) = node_pair.first;
+        traverse_beam_single(node_pair.second, (int*)(result.data + i * result.strides[0]), length, pad_id, dedup);
+    }
+}
+
+template<>
+void DagSearcher::traverse_beam(int batch_size, int pad_id,
+            __Pyx_memviewslice result,
+            __Pyx_memviewslice score,
+            int dedup) {
+
+    request_full_team();
+    #pragma omp parallel num_threads(thread_num)
+    traverse_beam_body(batch_size, pad_id, result, score, dedup);
+}
+
+// Every batch keeps the beam of its last step once it is past its output length, so later steps change nothing.
+int DagSearcher::search_steps(int batch_size, const int* output_length_data, int prelen)
+{
+    int steps = 0;
+    for(int i = 0; i < batch_size; i++) steps = max(steps, output_length_data[i]);
+    return min(steps, prelen);
+}
+
+// Every thread runs the same sequence of phases, the barriers at their ends replace a fork/join per phase.
+// expand_step(step) runs the expand_beam body matching the input format, it is skipped for steps no notify reaches.
+template<class T, class Expand>
+void DagSearcher::run_search(int batch_size, int prelen, T output_length, T result, T score, const SearchOptions &options, Expand expand_step)
+{
+    init_time = get_time = expand_time = traverse_time = 0;
+    prepare_length_penalty(options.alpha, options.length_penalty);
+    int steps = search_steps(batch_size, (const int*)output_length.data, prelen);
+
+    request_full_team();
+    #pragma omp parallel num_threads(thread_num)
+    {
+        bool master = omp_get_thread_num() == 0;
+        double last = omp_get_wtime(), now;
+        init_beam_body(batch_size, options.go_id);
+        if(master){ now = omp_get_wtime(); init_time += now - last; last = now; }
+
+        for(int step = 0; step < steps; step++){
+            get_beam_body(batch_size, step, output_length, options.gamma, options.beam_size, options.beamlensize, options.recombine);
+            if(master){ now = omp_get_wtime(); get_time += now - last; last = now; }
+            if(!step_dead[step]) expand_step(step);
+            if(master){ now = omp_get_wtime(); expand_time += now - last; last = now; }
         }
 
-        thread_expand_cache.write_back();
-        thread_notify_cache.write_back();
+        traverse_beam_body(batch_size, options.pad_id, result, score, options.dedup);
+        if(master){ now = omp_get_wtime(); traverse_time += now - last; }
     }
 }
+
+template<>
+void DagSearcher::search(int batch_size,
+            __Pyx_memviewslice output_length,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            __Pyx_memviewslice result,
+            __Pyx_memviewslice score,
+            const SearchOptions &options) {
+
+    run_search(batch_size, dagscores.shape[1], output_length, result, score, options, [&](int step){
+        expand_beam_body(batch_size, step, output_length, dagscores, nextstep_idx, logits_idx, lm_vocab,
+            options.top_p, options.no_consecutive_repeat_ngram, options.no_repeat_ngram, options.score_dtype);
+    });
+}
+
+template<>
+void DagSearcher::search_csr(int batch_size,
+            __Pyx_memviewslice output_length,
+            __Pyx_memviewslice row_offsets,
+            __Pyx_memviewslice dagscores,
+            __Pyx_memviewslice nextstep_idx,
+            __Pyx_memviewslice logits_idx,
+            __Pyx_memviewslice lm_vocab,
+            __Pyx_memviewslice result,
+            __Pyx_memviewslice score,
+            const SearchOptions &options) {
+
+    int prelen = result.shape[1];
+    run_search(batch_size, prelen, output_length, result, score, options, [&](int step){
+        expand_beam_csr_body(batch_size, step, prelen, output_length, row_offsets, dagscores, nextstep_idx, logits_idx, lm_vocab,
+            options.top_p, options.no_consecutive_repeat_ngram, options.no_repeat_ngram, options.score_dtype);
+    });
+}
@@ -5,9 +5,15 @@
 #include <algorithm>
 #include <unordered_map>
 #include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <omp.h>
 #include "lm/state.hh"
 #include "lm/virtual_interface.hh"
 #include "lm/model.hh"
+#include "LogSpace.h"
+#include "HalfFloat.h"
 using namespace std;
 // #define DEBUG
 
@@ -72,21 +78,31 @@ public:
 };
 
 struct SearchNode;
+struct HistoryChunk;
+template<class T, class K, class HashFunc> class ConcurrentHashMap;
+struct pair_hash;
+typedef ConcurrentHashMap<float, pair<SearchNode*, int>, pair_hash> NodeStepMap;
 class dagstep_get_or_create{
 public:
-    inline float& operator()(int nextstep, bool &create, int batch_id, SearchNode* nextnode);
+    inline float& operator()(int nextstep, bool &create, NodeStepMap* step_map, SearchNode* nextnode);
 };
 
 
-struct SearchNode
+struct SearchNode // Read when scoring beams, the fields used only while expanding are in SearchNodeState
 {
     SearchNode *parent;
     int word, length;
 
     float lmscore, dagscore;
+    int id; // index in DagSearcher::sn_pool, also addresses the node's SearchNodeState
+    int lm_state; // id of the interned KenLM state, see DagSearcher::lm_state
+};
+
+struct SearchNodeState // Cold part of a SearchNode, see DagSearcher::node_state
+{
     static const int QuickMapSize = 5;
     QuickMap<int, float, QuickMapSize, dagstep_get_or_create> dagstepscore_map;
-    lm::ngram::State lm_state;
+    HistoryChunk* history; // words of the hypothesis, only built for expanded nodes when repeat blocking is on
 };
 
 #ifdef DEBUG
@@ -112,34 +128,158 @@ inline void __debug_print_node(SearchNode* now){
     __printf("%d ", now->word);
 }
 
-inline float logaddexp(float a, float b){
-    float l = max(a, b);
-    if(isinf(l) != 0) return -INFINITY;
-    return log(exp(a - l) + exp(b - l)) + l;
-}
-
 inline bool node_compare_allscore(const pair<float, SearchNode*> &a, const pair<float, SearchNode*> & b){
     return a.first > b.first;
 }
-inline float calculate_score(SearchNode* node, float alpha, float gamma){
-    return (node->lmscore * gamma + node->dagscore) / pow(node->length, alpha);
+typedef pair<float, SearchNode*> BeamItem;
+struct BeamItemBetter{ // functors rather than function pointers, so that the heap operations get inlined
+    bool operator()(const BeamItem &a, const BeamItem &b) const { return a.first > b.first; }
+};
+struct BeamItemWorse{
+    bool operator()(const BeamItem &a, const BeamItem &b) const { return a.first < b.first; }
+};
+struct TopKBuffer // Streaming selection of the capacity best items in a fixed buffer of 2 * capacity
+{
+    BeamItem* items;
+    int count, capacity;
+    float threshold; // the capacity-th best score seen so far, worse items are rejected right away
+
+    void init(BeamItem* _items, int _capacity){
+        items = _items;
+        count = 0;
+        capacity = _capacity;
+        threshold = -INFINITY;
+    }
+    void offer(const BeamItem &item){
+        if(item.first < threshold) return;
+        items[count++] = item;
+        if(count == 2 * capacity) shrink();
+    }
+    void shrink(){
+        nth_element(items, items + capacity - 1, items + count, BeamItemBetter());
+        threshold = items[capacity - 1].first;
+        count = capacity;
+    }
+    int finish(){ // the best items are in items[0, count)
+        if(count > capacity) shrink();
+        return count;
+    }
+};
+// length_penalty[length] is the normalization of a hypothesis of that length, see DagSearcher::prepare_length_penalty
+inline float calculate_score(SearchNode* node, float gamma, const double* length_penalty){
+    return (node->lmscore * gamma + node->dagscore) / length_penalty[node->length];
 }
 
+enum RecombineMode // how hypotheses with the same LM state at the same DAG position and length are merged in get_beam
+{
+    RECOMBINE_NONE = 0,
+    RECOMBINE_MAX = 1,      // keep the best one
+    RECOMBINE_LOGSUMEXP = 2 // keep the best one, which also takes the probability mass of the others at this position.
+                            // Its dagscore, inherited by its descendants, is then summed over paths rather than the score of
+                            // the returned path, and not comparable with the scores of the other modes.
+};
+
+enum LengthPenaltyMode // the score of a hypothesis is (gamma * lmscore + dagscore) / penalty(length)
+{
+    LENGTH_PENALTY_POWER = 0, // length^alpha
+    LENGTH_PENALTY_GNMT = 1   // ((5 + length) / 6)^alpha, as in Wu et al. 2016
+};
+
+enum ScoreDtype // element type of dagscores, see HalfFloat.h
+{
+    SCORE_FLOAT32 = 0,
+    SCORE_FLOAT16 = 1,
+    SCORE_BFLOAT16 = 2
+};
+
 struct Notify
 {
     SearchNode* target;
     Notify* next;
 };
 
+struct NotifySegment // Notifies at (pos, length) written by one thread in one expand_beam, linked from NotifyCache::segments[batch][pos]
+{
+    int batch, length;
+    Notify* head;
+    NotifySegment* next;
+};
+
+struct HistoryChunk // Words at lengths [begin, begin + size) of a hypothesis, shared by the hypotheses extending it
+{
+    static const int size = 8;
+    HistoryChunk* prev; // holds the words before begin, always full
+    int begin;
+    atomic<int> used; // slots claimed so far, a node sharing the chunk may only own a prefix of them
+    int words[size];
+};
+
+class DagSearcher;
+
+class LMTransitionCache;
+// LMTransitionCache::score_pending instantiated for the concrete GenericModel type picked when the model is loaded, so
+// the FullScore of every transition is a direct call. The pointer is followed once per thread and step.
+typedef void (*LMScorePendingFunction)(LMTransitionCache &cache, DagSearcher* searcher);
+void lm_virtual_score_pending(LMTransitionCache &cache, DagSearcher* searcher); // BaseScore through the vtable
+
+class LMTransitionCache // Direct-mapped, per-thread memo of (state id, word) -> (score, next state id) for one search
+{
+public:
+    static const int cache_bits = 14, cache_size = 1 << cache_bits;
+
+    struct Entry
+    {
+        int in_state; // -1 if empty
+        lm::WordIndex word;
+        float score;
+        int out_state;
+    };
+    vector<Entry> entries;
+    long hits, lookups;
+
+    struct Pending
+    {
+        SearchNode* node;
+        lm::WordIndex word;
+    };
+    static const int prefetch_distance = 8;
+    vector<Pending> pending; // nodes created by this thread in the current step, their lmscore and lm_state are not set yet
+
+    void init(lm::base::Model* model){
+        if(model != nullptr && entries.empty()) entries.resize(cache_size);
+        clear();
+    }
+
+    void clear(){ // state ids are only valid within a search
+        for(auto &entry : entries) entry.in_state = -1;
+        hits = lookups = 0;
+        pending.clear();
+    }
+
+    Entry& entry(int in_state, lm::WordIndex word){
+        uint64_t key = ((uint64_t)(unsigned int)in_state << 32) | word;
+        return entries[(key * 0x9E3779B97F4A7C15ULL) >> (64 - cache_bits)];
+    }
+
+    template<class Model>
+    float score(DagSearcher* searcher, const Model* model, int in_state, lm::WordIndex word, int &out_state);
+    void defer(SearchNode* node, lm::WordIndex word){ pending.push_back({node, word}); }
+    template<class Model>
+    void score_pending(DagSearcher* searcher, const Model* model); // scores the deferred nodes, their parents must be scored already
+};
 class ExpandBeamCache
 {
 public:
+    DagSearcher* searcher;
+    LMTransitionCache* lm_cache;
     SearchNode* cached_nextnode;
     float cached_add_score;
     SearchNode* search_node;
     int search_nextword;
 
-    void init() { cached_nextnode = nullptr; search_node = nullptr; }
+    int nodes_created;
+
+    void init(DagSearcher* _searcher, LMTransitionCache* _lm_cache) { searcher = _searcher; lm_cache = _lm_cache; cached_nextnode = nullptr; search_node = nullptr; nodes_created = 0; }
     SearchNode* load(int batch, SearchNode* node, int nextword, int lm_word);
     void write_back();
     void addscore(float dagscore) { cached_add_score = logaddexp(cached_add_score, dagscore); }
@@ -158,60 +298,260 @@ struct pair_hash
     }
 };
 
-class NotifyCache
+class NotifyCache // Only written by its own thread, get_beam reads the segments of all threads.
 {
 public:
-    unordered_map<pair<int, pair<int, int>>, pair<Notify*, Notify*>, pair_hash> *local_head;
+    struct Entry
+    {
+        int batch, pos, length;
+        unsigned int version; // the entry is empty unless version is current
+        Notify* head;
+    };
+    static const int initial_table_size = 1024;
+
+    DagSearcher* searcher;
+    vector<Entry> table; // open addressing (linear probing) over (batch, pos, length), holds the notifies of one expand_beam
+    vector<int> used; // slots filled since the last write_back, in insertion order
+    unsigned int version;
+    vector<NotifySegment*> segments; // [batch * max_pos + pos]
+
+    void init(DagSearcher* _searcher, int max_batch_size, int max_pos){
+        searcher = _searcher;
+        table.assign(initial_table_size, Entry{0, 0, 0, 0, nullptr});
+        used.clear();
+        used.reserve(initial_table_size / 2);
+        version = 1;
+        segments.assign(max_batch_size * max_pos, nullptr);
+    }
 
-    void init(){
-        local_head = new unordered_map<pair<int, pair<int, int>>, pair<Notify*, Notify*>, pair_hash>;
+    static unsigned int hash(int batch, int pos, int length){
+        uint64_t key = ((uint64_t)(unsigned int)batch << 42) ^ ((uint64_t)(unsigned int)pos << 21) ^ (unsigned int)length;
+        return (key * 0x9E3779B97F4A7C15ULL) >> 32;
     }
 
+    Notify* &local_head(int batch, int pos, int length){
+        if((used.size() + 1) * 2 > table.size()) grow();
+        size_t mask = table.size() - 1;
+        for(size_t idx = hash(batch, pos, length) & mask; ; idx = (idx + 1) & mask){
+            Entry &entry = table[idx];
+            if(entry.version != version){
+                entry.batch = batch; entry.pos = pos; entry.length = length;
+                entry.version = version;
+                entry.head = nullptr;
+                used.push_back(idx);
+                return entry.head;
+            }
+            if(entry.batch == batch && entry.pos == pos && entry.length == length) return entry.head;
+        }
+    }
+
+    void grow();
+    void push_segment(int batch, int pos, int length, Notify* head);
     void write_back();
 };
 
+struct ExpandCandidate // One next-word candidate of a (batch, step) row, shared by all beams expanded at the step
+{
+    int word, lm_word, nextstep; // lm_word is -1 past the top_p cutoff of the row, see fill_candidates
+    float score, prob; // prob = exp(score), summed for the top_p cutoff
+};
+
+class RepeatBlocker // Marks the candidates banned by no_consecutive_repeat_ngram / no_repeat_ngram, reading the HistoryChunk list of a node
+{
+public:
+    static const uint64_t hash_base = 0x9E3779B97F4A7C15ULL;
+
+    vector<int> words; // [length] words of the hypothesis being expanded, words[0] is go_id
+    vector<uint64_t> prefix_hash; // [length] rolling hash of words[0..length]
+    vector<uint64_t> base_pow; // [n] hash_base ** n
+    vector<char> banned; // [j] the j-th candidate of the step is banned
+
+    static uint64_t extend_hash(uint64_t prefix, int word) { return prefix * hash_base + (unsigned int)word + 1; }
+
+    void mark(const HistoryChunk* history, int len, const ExpandCandidate* cands, int cand_n, int no_consecutive_repeat_ngram, int no_repeat_ngram);
+
+private:
+    uint64_t power(int n);
+    uint64_t ngram_hash(int end, int n, uint64_t pow_n) const { // words (end - n, end], needs end - n + 1 >= 0
+        return end >= n ? prefix_hash[end] - prefix_hash[end - n] * pow_n : prefix_hash[end];
+    }
+    bool same_ngram(int end1, int end2, int n);
+    void ban(int word, const ExpandCandidate* cands, int cand_n) {
+        for(int j = 0; j < cand_n; j++) if(cands[j].word == word) banned[j] = 1;
+    }
+};
+
+struct RecombineItem
+{
+    int lm_state;
+    float score;
+    SearchNode* node;
+    bool operator<(const RecombineItem &other) const {
+        return lm_state < other.lm_state || (lm_state == other.lm_state && score > other.score);
+    }
+};
+
+struct SearchOptions // Arguments of DagSearcher::search besides the tensors
+{
+    float alpha, gamma, top_p;
+    int beam_size, beamlensize;
+    int pad_id, go_id, dedup;
+    int no_consecutive_repeat_ngram, no_repeat_ngram;
+    int recombine;
+    int length_penalty; // LengthPenaltyMode
+    int score_dtype; // ScoreDtype
+};
+
+struct ThreadContext // Everything a worker thread writes privately during a search step
+{
+    ExpandBeamCache expand_cache;
+    NotifyCache notify_cache;
+    LMTransitionCache lm_cache;
+    RepeatBlocker repeat_blocker;
+    vector<RecombineItem> recombine_buf;
+    vector<BeamItem> candidate_buf;
+    vector<pair<float, int>> merge_heads;
+};
+
+template<class T>
+class SlabArray // Items addressed by a global index, in fixed-size slabs allocated on first use
+{
+public:
+    static const int slab_bits = 16, slab_size = 1 << slab_bits, slab_mask = slab_size - 1;
+    static const int max_slabs = 1 << 14;
+
+    atomic<T*> slabs[max_slabs];
+    mutex grow_mutex;
+
+    SlabArray(){
+        for(int i = 0; i < max_slabs; i++) slabs[i].store(nullptr, memory_order_relaxed);
+    }
+    ~SlabArray(){
+        for(int i = 0; i < max_slabs; i++) delete[] slabs[i].load(memory_order_relaxed);
+    }
+
+    T* get(int pos){ // the slab must exist
+        return slabs[pos >> slab_bits].load(memory_order_relaxed) + (pos & slab_mask);
+    }
+    T* get_or_create(int pos){
+        return get_slab(pos >> slab_bits) + (pos & slab_mask);
+    }
+
+    T* get_slab(int slab_id){
+        T* slab = slabs[slab_id].load(memory_order_acquire);
+        if(slab != nullptr) return slab;
+        lock_guard<mutex> lock(grow_mutex);
+        slab = slabs[slab_id].load(memory_order_relaxed);
+        if(slab == nullptr){
+            slab = new T[slab_size];
+            slabs[slab_id].store(slab, memory_order_release);
+        }
+        return slab;
+    }
+
+    void release_from(int first_slab){ // not thread safe
+        for(int i = first_slab; i < max_slabs; i++){
+            T* slab = slabs[i].load(memory_order_relaxed);
+            if(slab == nullptr) break;
+            slabs[i].store(nullptr, memory_order_relaxed);
+            delete[] slab;
+        }
+    }
+
+    size_t allocated_bytes(){
+        size_t res = 0;
+        for(int i = 0; i < max_slabs && slabs[i].load(memory_order_relaxed); i++) res += sizeof(T) * slab_size;
+        return res;
+    }
+};
+
 template<class T>
-class MultiThreadMemPool
+class MultiThreadMemPool // Hands out SlabArray items to threads in chunks. Items are addressed by a global index, so they can be stored as int.
 {
 public:
-    T* pool;
-    atomic<T*> shared_pool_pt;
-    int pool_size;
+    static const int slab_bits = SlabArray<T>::slab_bits, slab_size = SlabArray<T>::slab_size, slab_mask = SlabArray<T>::slab_mask;
+    static const int max_slabs = SlabArray<T>::max_slabs;
     static const int buf_per_thread = 1024, randomized_buf_per_thread = 1024;
 
-    struct ThreadBuffer
+    SlabArray<T> storage;
+    atomic<int> shared_pool_pos;
+    int reserve_slabs;
+
+    struct ThreadBuffer // one per omp thread, padded to a cache line
     {
         T *private_pool_pt, *private_pool_pt_end;
+        int private_pool_pos;
+        char padding[64 - 2 * sizeof(T*) - sizeof(int)];
     };
-    static ThreadBuffer tbuf;
-    # pragma omp threadprivate(tbuf)
+    ThreadBuffer* tbuf;
+    int thread_num;
+
+    MultiThreadMemPool(){
+        shared_pool_pos.store(0, memory_order_relaxed);
+        reserve_slabs = 0;
+        tbuf = nullptr;
+        thread_num = 0;
+    }
+    ~MultiThreadMemPool(){
+        delete[] tbuf;
+    }
 
-    void init_global(int _pool_size){
-        pool_size = _pool_size;
-        pool = new T[pool_size];
+    void init_global(int reserve_size, int _thread_num){ // slabs covering reserve_size items are allocated now and never released
+        reserve_slabs = min((reserve_size + slab_size - 1) / slab_size, (int)max_slabs);
+        for(int i = 0; i < reserve_slabs; i++) storage.get_slab(i);
+        thread_num = _thread_num;
+        tbuf = new ThreadBuffer[thread_num];
     }
 
-    void clear_global(){
-        shared_pool_pt = pool;
+    int clear_global(){ // returns the number of slabs kept
+        // Keep the slabs used by the last search (high-water) and the reserve, release the others.
+        int used_slabs = (shared_pool_pos.load(memory_order_relaxed) + slab_size - 1) / slab_size;
+        int kept_slabs = max(used_slabs, reserve_slabs);
+        storage.release_from(kept_slabs);
+        shared_pool_pos.store(0, memory_order_relaxed);
+        return kept_slabs;
     }
     void clear_thread(){
-        tbuf.private_pool_pt = tbuf.private_pool_pt_end = pool;
+        ThreadBuffer &buf = tbuf[omp_get_thread_num()];
+        buf.private_pool_pt = buf.private_pool_pt_end = nullptr;
+        buf.private_pool_pos = 0;
+    }
+
+    size_t allocated_bytes(){
+        return storage.allocated_bytes();
+    }
+
+    T* get(int pos){
+        return storage.get(pos);
     }
 
     T* allocate(){
-        if(tbuf.private_pool_pt < tbuf.private_pool_pt_end) return tbuf.private_pool_pt++;
-        int allocate_size = buf_per_thread + rand() % randomized_buf_per_thread;
-        tbuf.private_pool_pt = shared_pool_pt.fetch_add(allocate_size, memory_order_relaxed);
-        tbuf.private_pool_pt_end = tbuf.private_pool_pt + allocate_size;
+        int pos;
+        return allocate(pos);
+    }
 
-        // #ifdef DEBUG
-        if(tbuf.private_pool_pt_end - pool > pool_size){
+    T* allocate(int &pos){
+        ThreadBuffer &buf = tbuf[omp_get_thread_num()];
+        if(buf.private_pool_pt < buf.private_pool_pt_end){
+            pos = buf.private_pool_pos++;
+            return buf.private_pool_pt++;
+        }
+        int allocate_size = buf_per_thread + rand() % randomized_buf_per_thread;
+        int start = shared_pool_pos.fetch_add(allocate_size, memory_order_relaxed);
+        int slab_id = start >> slab_bits;
+        if(slab_id >= max_slabs){
             __printf("memory exceeded!!!");
-            exit(-1);
+            abort();
         }
-        // #endif
-
-        return tbuf.private_pool_pt++;
+        // a thread buffer never crosses a slab boundary, the tail beyond it is simply skipped
+        int end = min(start + allocate_size, (slab_id + 1) << slab_bits);
+        T* slab = storage.get_slab(slab_id);
+        buf.private_pool_pt = slab + (start & slab_mask);
+        buf.private_pool_pt_end = buf.private_pool_pt + (end - start);
+        buf.private_pool_pos = start;
+
+        pos = buf.private_pool_pos++;
+        return buf.private_pool_pt++;
     }
 };
 
@@ -242,6 +582,11 @@ public:
         head_verison = 0;
         for(int i = 0; i < head_size; i++) head_atomic[i].store({0, 0}, memory_order_relaxed);
     }
+    ~ConcurrentHashMap(){
+        delete[] head_atomic;
+    }
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete; // owns head_atomic
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
     void clear() {
         head_verison++;
     }
@@ -249,10 +594,10 @@ public:
         return cur.version == head_verison;
     }
     Node* get_point(const HeadPointer &cur) {
-        return pool->pool + cur.pos;
+        return pool->get(cur.pos);
     }
-    HeadPointer store_point(Node* cur) {
-        return {(int)(cur - pool->pool), head_verison};
+    HeadPointer store_point(int pos) {
+        return {pos, head_verison};
     }
     T* get(const K &key, memory_order sync) {
         unsigned int idx = func(key) % head_size;
@@ -276,6 +621,7 @@ public:
     T& get_or_create(const K &key, bool& create, memory_order sync){
 
         Node* cur = nullptr, *oricur = nullptr, *allo = nullptr;
+        int allo_pos;
         create = true;
         // #pragma omp critical
         {
@@ -293,37 +639,228 @@ public:
                     cur = cur->next;
                 }
                 if(allo == nullptr){
-                    allo = pool->allocate();
+                    allo = pool->allocate(allo_pos);
                     allo->key = key;
                 }
                 allo->next = oricur;
-            }while(!head_atomic[idx].compare_exchange_weak(cur_hp, store_point(allo), memory_order_acq_rel));
+            }while(!head_atomic[idx].compare_exchange_weak(cur_hp, store_point(allo_pos), memory_order_acq_rel));
         }
         return allo->value;
     }
+
+    int intern(const K &key){ // For maps whose value is the index of its node in pool: returns the index of key's node
+        Node* cur = nullptr, *oricur = nullptr, *allo = nullptr;
+        int allo_pos;
+        unsigned int idx = func(key) % head_size;
+        HeadPointer cur_hp = head_atomic[idx].load(memory_order_acquire);
+        do{
+            if(test_valid(cur_hp)){
+                oricur = cur = get_point(cur_hp);
+            }
+            while(cur){
+                if(cur->key == key) return cur->value;
+                cur = cur->next;
+            }
+            if(allo == nullptr){
+                allo = pool->allocate(allo_pos);
+                allo->key = key;
+                allo->value = allo_pos; // set before the node is published
+            }
+            allo->next = oricur;
+        }while(!head_atomic[idx].compare_exchange_weak(cur_hp, store_point(allo_pos), memory_order_acq_rel));
+        return allo_pos;
+    }
+};
+
+template<int Order>
+struct CompactLMState // lm::ngram::State of a model of this order, without the room for KENLM_MAX_ORDER words
+{
+    lm::WordIndex words[Order - 1];
+    float backoff[Order - 1];
+    unsigned char length;
+
+    void assign(const lm::ngram::State &state){
+        length = state.length;
+        std::copy(state.words, state.words + length, words);
+        std::copy(state.backoff, state.backoff + length, backoff);
+    }
+    void expand(lm::ngram::State &state) const {
+        state.length = length;
+        std::copy(words, words + length, state.words);
+        std::copy(backoff, backoff + length, state.backoff);
+    }
+    bool operator==(const CompactLMState &other) const { // like lm::ngram::State, the backoffs follow from the words
+        return length == other.length && std::equal(words, words + length, other.words);
+    }
+};
+
+struct compact_lm_state_hash
+{
+    template<int Order>
+    std::size_t operator() (const CompactLMState<Order> &state) const {
+        return util::MurmurHashNative(state.words, sizeof(lm::WordIndex) * state.length, 0);
+    }
+};
+
+class LMStateTable // Distinct KenLM states of the current search, a state id is the index of its node in the pool
+{
+public:
+    virtual ~LMStateTable(){}
+    virtual void get(int id, lm::ngram::State &state) = 0;
+    virtual int intern(const lm::ngram::State &state) = 0; // may be called parallelly
+    virtual void clear_global() = 0;
+    virtual void clear_thread() = 0;
+    virtual size_t allocated_bytes() = 0;
+};
+
+// Only called on LMTransitionCache misses, so the virtual calls are cheap enough to pick Order from the loaded model
+template<int Order>
+class CompactLMStateTable : public LMStateTable
+{
+public:
+    typedef ConcurrentHashMap<int, CompactLMState<Order>, compact_lm_state_hash> StateMap;
+    MultiThreadMemPool<typename StateMap::Node> pool;
+    StateMap state_map;
+
+    CompactLMStateTable(int hash_size, int thread_num) : state_map(hash_size, &pool) {
+        pool.init_global(0, thread_num);
+    }
+    void get(int id, lm::ngram::State &state){ pool.get(id)->key.expand(state); }
+    int intern(const lm::ngram::State &state){
+        CompactLMState<Order> key;
+        key.assign(state);
+        return state_map.intern(key);
+    }
+    void clear_global(){
+        pool.clear_global();
+        state_map.clear();
+    }
+    void clear_thread(){ pool.clear_thread(); }
+    size_t allocated_bytes(){ return pool.allocated_bytes(); }
 };
 
 typedef pair<SearchNode*, int> HashKey;
-typedef pair<int, int> HashNotifyKey;
 
-typedef ConcurrentHashMap<float, HashKey, pair_hash> NodeStepMap;
 typedef ConcurrentHashMap<SearchNode*, HashKey, pair_hash> NodeChildrenMap;
-typedef ConcurrentHashMap<atomic<Notify*>, HashNotifyKey, pair_hash> NodeNotifyMap;
 typedef SearchNode* SearchNode_pt;
 
-extern int max_pos;
-extern vector<pair<float, SearchNode*>>** beams;
-extern NodeNotifyMap** node_notify_map_atomic;
-extern NodeStepMap** node_step_map;
-
-int query_vocab_index(char* word);
-void global_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int thread_num, char* lm_path);
-void init_beam(int batch_size, int go_id);
-
-template<class T>
-void expand_beam(int batch_size, int step, T output_length, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram);
+class DagSearcher // Owns all the state of one search configuration. Different searchers can run concurrently.
+{
+public:
+    int max_pos, max_batch_size, thread_num;
+    lm::base::Model* model;
+    LMScorePendingFunction lm_score_pending; // scores the nodes deferred by a thread, see select_lm_score_pending
+
+    int beam_capacity;
+    vector<BeamItem> beam_items; // [batch * beam_capacity], the beam of each batch at the current step, unordered
+    vector<int> beam_count; // [batch]
+    vector<BeamItem> unit_items; // scratch of get_beam: the best beamlensize items of each (batch, length) group
+    vector<int> unit_count;
+    static const int score_chunk_size = 64;
+    static const int tournament_ratio = 4; // step2 uses a tournament if at most 1/tournament_ratio of the winners are kept
+    vector<int> chunk_begin; // scratch of expand_beam: index of the first expanded beam of each batch, and the total
+    struct WorkUnit { int batch, begin, end; }; // expanded beams [begin, end), the first one belongs to batch
+    vector<WorkUnit> work_units; // scratch of expand_beam: the beams in units of similar cost, taken by the threads in turn
+    static const int work_beam_overhead = 4; // cost of a beam besides its candidates, in candidates
+    static const int work_units_per_thread = 8;
+    static const int work_unit_min_cost = 64;
+    vector<ExpandCandidate> step_candidates; // scratch of expand_beam: [batch * cand_stride] candidates at the step
+    int cand_stride;
+    vector<int> step_cand_count; // scratch of expand_beam: [batch] candidates of the batch at the step
+    vector<int> step_cutoff; // scratch of expand_beam: [batch] candidates within top_p if none is banned
+    const int* step_lm_vocab; // lm_vocab of the step, for the lm_word of candidates past the cutoff
+    int chunk_size;
+    double init_time, get_time, expand_time, traverse_time; // seconds spent in each phase by the last search()
+    vector<NotifySegment*> step_segments; // scratch of get_beam: segments of the current step, sorted by (batch, length)
+    vector<int> step_units; // begin of each (batch, length) group in step_segments
+    vector<int> step_unit_begin; // first group of each batch in step_units
+    vector<char> step_dead; // [step] set by get_beam: no notify at the step in any batch, expand_beam is skipped
+    vector<double> length_penalty; // [length], built for length_penalty_alpha and length_penalty_mode
+    float length_penalty_alpha;
+    int length_penalty_mode;
+    NodeStepMap** node_step_map;
+    NodeChildrenMap** node_children_map;
+    LMStateTable* lm_states; // sized for the order of model, nullptr without a model
+
+    MultiThreadMemPool<SearchNode> sn_pool;
+    SlabArray<SearchNodeState> node_states; // [SearchNode::id], slab i exists whenever slab i of sn_pool does
+    MultiThreadMemPool<Notify> ntf_pool;
+    MultiThreadMemPool<NodeStepMap::Node> ns_pool;
+    MultiThreadMemPool<NodeChildrenMap::Node> nc_pool;
+    MultiThreadMemPool<NotifySegment> seg_pool;
+    MultiThreadMemPool<HistoryChunk> hc_pool;
+
+    ThreadContext* thread_context; // indexed by omp_get_thread_num()
+
+    DagSearcher(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int thread_num, int pool_reserve, char* lm_path);
+    ~DagSearcher();
+
+    int query_vocab_index(char* word);
+    size_t pool_allocated_bytes();
+    int nodes_created();
+    long lm_cache_hits();
+    long lm_cache_lookups();
+
+    // The whole search in one parallel region: init_beam, then get_beam and expand_beam for each step, then traverse_beam.
+    template<class T>
+    void search(int batch_size, T output_length, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, T result, T score, const SearchOptions &options);
+    // The same search on a DAG in CSR form: the candidates of (batch, pos) are the entries [row_offsets[r], row_offsets[r + 1])
+    // of the flat dagscores, nextstep_idx and logits_idx, with r = batch * prelen + pos. prelen is result.shape[1].
+    template<class T>
+    void search_csr(int batch_size, T output_length, T row_offsets, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, T result, T score, const SearchOptions &options);
+
+    // The phases of search, each in its own parallel region.
+    int search_steps(int batch_size, const int* output_length_data, int prelen); // steps that can change the result
+    void init_beam(int batch_size, int go_id);
+    template<class T>
+    void get_beam(int batch_size, int step, T output_length, float alpha, float gamma, int beam_size, int beamlensize, int recombine, int length_penalty_mode = LENGTH_PENALTY_POWER);
+    template<class T>
+    void expand_beam(int batch_size, int step, T output_length, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram, int score_dtype = SCORE_FLOAT32);
+    template<class T>
+    void traverse_beam(int batch_size, int pad_id, T result, T score, int dedup);
+
+    // The bodies of the phases are run by every thread of an enclosing parallel region, and end with a barrier.
+    void init_beam_body(int batch_size, int go_id);
+    template<class T>
+    void get_beam_body(int batch_size, int step, T output_length, float gamma, int beam_size, int beamlensize, int recombine); // needs prepare_length_penalty
+    template<class T>
+    void expand_beam_body(int batch_size, int step, T output_length, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram, int score_dtype);
+    template<class T>
+    void expand_beam_csr_body(int batch_size, int step, int prelen, T output_length, T row_offsets, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram, int score_dtype);
+    template<class T>
+    void traverse_beam_body(int batch_size, int pad_id, T result, T score, int dedup);
+    template<class T, class Expand>
+    void run_search(int batch_size, int prelen, T output_length, T result, T score, const SearchOptions &options, Expand expand_step);
+    void prepare_chunk(int batch_size, int step, const int* output_length_data);
+    void prepare_work_units(int batch_size, bool repeat_blocking);
+    void expand_one_beam(ThreadContext &ctx, int step, int now_batch, int now_beam, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram);
+    template<class T>
+    void prepare_candidates(int batch_size, int step, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int score_dtype);
+    template<class T>
+    void prepare_candidates_csr(int batch_size, int step, int prelen, T row_offsets, T dagscores, T nextstep_idx, T logits_idx, T lm_vocab, float top_p, int score_dtype);
+    void fill_candidates(int batch, int cand_n, int score_dtype, const char* scores, ptrdiff_t score_stride,
+                const char* nextsteps, ptrdiff_t nextstep_stride, const char* words, ptrdiff_t word_stride, const int* lm_vocab_data, float top_p);
+    template<class S>
+    void fill_candidates(int batch, int cand_n, const char* scores, ptrdiff_t score_stride,
+                const char* nextsteps, ptrdiff_t nextstep_stride, const char* words, ptrdiff_t word_stride, const int* lm_vocab_data, float top_p);
+    void expand_candidates(int step, float top_p, int no_consecutive_repeat_ngram, int no_repeat_ngram); // the rest of both expand_beam bodies
+
+    SearchNode* allocate_node(SearchNode* parent, int word, int lm_word, LMTransitionCache* lm_cache);
+    SearchNodeState& node_state(const SearchNode* node){ return *node_states.get(node->id); }
+    void lm_state(int id, lm::ngram::State &state){ lm_states->get(id, state); }
+    int intern_lm_state(const lm::ngram::State &state){ return lm_states->intern(state); }
+    void build_history(SearchNode* node);
+    void insert_notify(ThreadContext &ctx, int batch, SearchNode* target, int pos, int length);
+    void direct_insert_notify(ThreadContext &ctx, int batch, SearchNode* target, int pos, int length);
+    void add_step_dagscore(ThreadContext &ctx, int batch, SearchNode* nextnode, int nextstep, float dagscore);
+    void init_start_node(ThreadContext &ctx, int batch, int go_id);
+    void expand_path(ThreadContext &ctx, int batch, SearchNode* node, int nextstep, int word, int lm_word, float dagscore);
+    int tournament_select(ThreadContext &ctx, int unit_stride, int unit_begin, int unit_end, int beam_size, BeamItem* beam);
+    void recombine_beam(ThreadContext &ctx, vector<pair<float, SearchNode*>> &beam, int batch, int step, int recombine, float gamma);
+    void prepare_length_penalty(float alpha, int mode);
+};
 
-inline float& dagstep_get_or_create::operator()(int nextstep, bool &create, int batch_id, SearchNode* nextnode)
+inline float& dagstep_get_or_create::operator()(int nextstep, bool &create, NodeStepMap* step_map, SearchNode* nextnode)
 {
-    return node_step_map[batch_id]->get_or_create(make_pair(nextnode, nextstep), create, memory_order_relaxed);
-}
\ No newline at end of file
+    return step_map->get_or_create(make_pair(nextnode, nextstep), create, memory_order_relaxed);
+}
@@ -2,33 +2,28 @@
 # cython: infer_types=True
 # cython: language_level=3
 
-cimport _kenlm
 cimport cython
-cimport openmp
 import os
 import numpy as np
-import time
-import sys
-from libcpp.vector cimport vector
-from libcpp cimport bool
-from algorithm cimport nth_element, upper_bound, sort
-from algorithm cimport max as cmax
-from libc.math cimport INFINITY
-from cython.operator cimport dereference as deref, preincrement as inc, address as addr
-from cython.parallel import prange
-from libcpp.utility cimport pair
-from atomic cimport atomic, memory_order
 cimport SearchBeam
 from SearchBeam cimport __printf as printf
-from SearchBeam cimport beams, node_notify_map_atomic
-from SearchBeam cimport SearchNode, Notify, ExpandBeamCache, SearchNode_pt
-from SearchBeam cimport init_beam, node_compare_allscore, calculate_score, make_pair, array_new, array_delete, expand_beam
+
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+RECOMBINE_NONE = SearchBeam.RECOMBINE_NONE
+RECOMBINE_MAX = SearchBeam.RECOMBINE_MAX
+RECOMBINE_LOGSUMEXP = SearchBeam.RECOMBINE_LOGSUMEXP
+LENGTH_PENALTY_POWER = SearchBeam.LENGTH_PENALTY_POWER
+LENGTH_PENALTY_GNMT = SearchBeam.LENGTH_PENALTY_GNMT
+SCORE_FLOAT32 = SearchBeam.SCORE_FLOAT32
+SCORE_FLOAT16 = SearchBeam.SCORE_FLOAT16
+SCORE_BFLOAT16 = SearchBeam.SCORE_BFLOAT16
 
 init_time = 0
 update_time = 0
 expand_time = 0
-lm_vocab = None
-max_token = None
+default_searcher = None
 
 cdef bytes as_str(data):
     if isinstance(data, bytes):
@@ -37,176 +32,260 @@ cdef bytes as_str(data):
         return data.encode('utf8')
     raise TypeError('Cannot convert %s to string' % type(data))
 
-def beam_search_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int threads_per_worker, tgt_dict, path=None):
-    # Allocate memory and load vocabulary
-    global lm_vocab
-    global max_token
-    lm_vocab = np.zeros(len(tgt_dict.symbols), dtype=np.intc)
-    max_token = min(maxtoken, batch_size * maxpos)
-    if path is not None:
-        path = os.path.abspath(as_str(path))
-        SearchBeam.global_init(batch_size, beam_size, top_cand_n, maxpos, max_token, threads_per_worker, path)
-        #printf("load vocab start")
-        for i, word in enumerate(tgt_dict.symbols):
-            lm_vocab[i] = SearchBeam.query_vocab_index(as_str(word))
-        #printf("load vocab end")
-    else:
-        SearchBeam.global_init(batch_size, beam_size, top_cand_n, maxpos, max_token, threads_per_worker, <char*>0)
+cdef class DagSearcher:
+    # Owns the memory pools, hash maps and LM of one search configuration.
+    # Several searchers can decode concurrently from different Python threads, the GIL is released during the search.
+    cdef SearchBeam.DagSearcher* c_searcher
+    cdef readonly object lm_vocab
+    cdef object lock
+    cdef object executor # runs search_async, created on first use
 
-@cython.boundscheck(False)
-@cython.wraparound(False)
-def dag_search(float[:, :, ::1] dagscores, int[:, :, ::1] nextstep_idx,
-        int[:, :, ::1] logits_idx, int[::1] output_length,
-        float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id, int go_id, int dedup,
-        int no_consecutive_repeat_ngram, int no_repeat_ngram):
+    def __cinit__(self, int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int threads_per_worker, tgt_dict, path=None, int pool_reserve=0):
+        # Allocate memory and load vocabulary
+        # Memory pools grow on demand. pool_reserve nodes (and other items) are kept allocated between searches.
+        self.lock = threading.Lock()
+        self.lm_vocab = np.zeros(len(tgt_dict.symbols), dtype=np.intc)
+        max_token = min(maxtoken, batch_size * maxpos)
+        if path is not None:
+            path = os.path.abspath(as_str(path))
+            self.c_searcher = new SearchBeam.DagSearcher(batch_size, beam_size, top_cand_n, maxpos, max_token, threads_per_worker, pool_reserve, path)
+            #printf("load vocab start")
+            for i, word in enumerate(tgt_dict.symbols):
+                self.lm_vocab[i] = self.c_searcher.query_vocab_index(as_str(word))
+            #printf("load vocab end")
+        else:
+            self.c_searcher = new SearchBeam.DagSearcher(batch_size, beam_size, top_cand_n, maxpos, max_token, threads_per_worker, pool_reserve, <char*>0)
 
-    batch_size = dagscores.shape[0]
-    prelen = dagscores.shape[1]
+    def __dealloc__(self):
+        del self.c_searcher
 
-    global init_time, update_time, expand_time, lm_vocab
+    def stats(self):
+        # Counters of the last search
+        return {"nodes_created": self.c_searcher.nodes_created(),
+                "lm_cache_hits": self.c_searcher.lm_cache_hits(),
+                "lm_cache_lookups": self.c_searcher.lm_cache_lookups(),
+                "pool_bytes": self.c_searcher.pool_allocated_bytes()}
 
-    if SearchBeam.__debug_flag:
-        printf("before init node\n")
-        start_init = time.time()
-    assert np.sum(output_length) < max_token
-    init_beam(batch_size, go_id)
-    if SearchBeam.__debug_flag:
-        printf("after init node\n")
-        init_time += time.time() - start_init
+    @cython.boundscheck(False)
+    @cython.wraparound(False)
+    def search(self, dagscores, nextstep_idx, logits_idx, output_length,
+            float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id, int go_id, int dedup,
+            int no_consecutive_repeat_ngram, int no_repeat_ngram, int recombine=RECOMBINE_NONE,
+            int length_penalty=LENGTH_PENALTY_POWER, result=None, score=None, score_dtype=None):
+        # recombine: merge hypotheses that reach the same DAG position with the same length and LM state (needs an LM).
+        #   RECOMBINE_MAX keeps the best one, RECOMBINE_LOGSUMEXP also adds the probability of the others to it, so its
+        #   scores are marginals over the merged paths and cannot be compared with the scores of the other modes.
+        # length_penalty: scores are divided by length^alpha (LENGTH_PENALTY_POWER) or ((5 + length) / 6)^alpha (LENGTH_PENALTY_GNMT).
+        # dagscores may be float32, float16 or bfloat16 (e.g. ml_dtypes.bfloat16), 16-bit scores are widened by the engine.
+        # score_dtype (SCORE_FLOAT32, SCORE_FLOAT16 or SCORE_BFLOAT16) declares their format instead of the array dtype, then
+        # any 16-bit array holds the bits of 16-bit scores: numpy cannot import a torch bfloat16 tensor, pass
+        # tensor.view(torch.int16) with score_dtype=SCORE_BFLOAT16.
+        # The inputs may be numpy arrays, buffer protocol objects or DLPack CPU tensors with any strides, they are not copied.
+        # result (int32, at least batch_size x prelen, rows contiguous) and score (float32, at least batch_size) are optional
+        # preallocated outputs, written in place; the returned arrays are views of them.
 
-    cdef int i
-    cdef int [::1] lm_vocab_view = lm_vocab
+        dagscores = as_array(dagscores)
+        cdef int batch_size = dagscores.shape[0]
+        cdef int prelen = dagscores.shape[1]
+        cdef const int[:, :, :] nextstep_view = as_array(nextstep_idx)
+        cdef const int[:, :, :] logits_view = as_array(logits_idx)
+        cdef const int[::1] output_length_view = np.ascontiguousarray(as_array(output_length))
+        cdef int [::1] lm_vocab_view = self.lm_vocab
+        cdef SearchBeam.DagSearcher* searcher = self.c_searcher
+        cdef SearchBeam.SearchOptions options = make_options(alpha, gamma, beam_size, beamlensize, top_p, pad_id, go_id, dedup,
+            no_consecutive_repeat_ngram, no_repeat_ngram, recombine, length_penalty)
+        options.score_dtype = score_dtype_of(dagscores, score_dtype)
+        cdef const float[:, :, :] dagscores_f32
+        cdef const unsigned short[:, :, :] dagscores_16
+        if options.score_dtype == SearchBeam.SCORE_FLOAT32:
+            dagscores_f32 = dagscores
+        else:
+            dagscores_16 = dagscores.view(np.uint16)
 
-    for i in range(prelen):
-        if SearchBeam.__debug_flag:
-            printf("dag_search: i = %d\n", i)
-            start = time.time()
-        get_beam(batch_size, i, output_length, alpha, gamma, beam_size, beamlensize)
-        if SearchBeam.__debug_flag:
-            printf("dag_search: finish get beam\n")
-            start2 = time.time()
-        expand_beam(batch_size, i, output_length, dagscores, nextstep_idx, logits_idx, lm_vocab_view, top_p, no_consecutive_repeat_ngram, no_repeat_ngram)
-        if SearchBeam.__debug_flag:
-            printf("dag_search: finish expand beam\n")
-            start3 = time.time()
-            update_time += start2 - start
-            expand_time += start3 - start
-
-    result = np.zeros((batch_size, prelen), dtype=np.intc)
-    score = np.zeros((batch_size), dtype=np.float32)
-    if SearchBeam.__debug_flag:
-        printf("dag_search: before traverse\n")
-    traverse_beam(batch_size, pad_id, result, score, dedup)
-    if SearchBeam.__debug_flag:
-        printf("dag_search: after traverse\n")
-        print(f"init_time {init_time} update_time {update_time}, expand_time {expand_time}")
-    output_len = (result != pad_id).sum(axis=-1).max()
-    return result[:, :output_len], score
-
-@cython.wraparound(False)
-@cython.boundscheck(False)
-cdef void get_beam(int batch_size, int step, int[::1] output_length,
-    float alpha, float gamma, int beam_size, int beamlensize) nogil:
-
-    cdef Notify* root
-    cdef atomic[Notify*]* root_atomic
-    cdef int i, j, now_beam_size, length, pid, tid, block
-    cdef vector[pair[float, SearchNode_pt]]* beam
-    cdef SearchNode* node
-    cdef vector[SearchNode*]* beam_tmp
-    cdef vector[int]* beam_cnt
-
-
-    # step1: find all first beamlensize at (batch_id=i, length=j)
-
-    block = step // 5 + 1
-
-    for pid in prange(batch_size * block * 5, nogil=True, schedule="guided"):
-
-        i = pid // (block * 5) # batch
-        j = pid % (block * 5)  # step
-        j = j // block + (j % block) * 5
-        if j > step:
-            continue
-
-        beam = beams[i * SearchBeam.max_pos + j]
-        if step < output_length[i]:
-            beam.clear()
-
-            now_beam_size = 1 if step == output_length[i] - 1 else beamlensize
-
-            root_atomic = node_notify_map_atomic[i].get(make_pair(<int>step, <int>j), memory_order.memory_order_relaxed)
-            if root_atomic == <atomic[Notify*]*>0:
-                continue
-            root = root_atomic.load(memory_order.memory_order_relaxed)
-            # printf("getbeam batch=%d notify_root=%p\n", i, root)
-            while root != <Notify*>0:
-                beam.push_back(make_pair(calculate_score(root.target, alpha, gamma), <SearchNode_pt>root.target))
-                root = root.next
-            if (<int>beam.size()) > now_beam_size:
-                nth_element(beam.begin(), beam.begin() + now_beam_size, beam.end(),
-                     node_compare_allscore)
-                beam.resize(now_beam_size)
-
-        # printf("get_beam-step1-prange-end tid:%d pid:%d\n", tid, pid)
-
-    # step2: find beamsize at batch=i
-    for i in prange(batch_size, nogil=True, schedule="guided"):
-        # tid = openmp.omp_get_thread_num()
-        # printf("get_beam-step2-prange-start tid:%d pid:%d\n", tid, i)
-
-        beam = beams[i * SearchBeam.max_pos]
-        if step < output_length[i]:
-            now_beam_size = 1 if step == output_length[i] - 1 else beam_size
-
-            for j in range(1, step + 1):
-                beam.insert(beam.end(), beams[i * SearchBeam.max_pos + j].begin(), beams[i * SearchBeam.max_pos + j].end())
-            if (<int>beam.size()) > now_beam_size:
-                nth_element(beam.begin(), beam.begin() + now_beam_size, beam.end(),
-                     node_compare_allscore)
-                beam.resize(now_beam_size)
+        result, score = output_arrays(result, score, batch_size, prelen)
+        cdef int[:, :] result_view = result
+        cdef float[:] score_view = score
 
-        if SearchBeam.__debug_flag:
-            printf("getbeam finished, batch=%d beams:\n", i, )
-            for j in range(<int>beam.size()):
-                printf("\t[")
-                node = deref(beam)[j].second
-                SearchBeam.__debug_print_node(node)
-                printf("] allscore=%f dagscore=%f lmscore=%f length=%d\n", deref(beam)[j].first, node.dagscore, node.lmscore, node.length)
-
-        # printf("get_beam-step2-prange-end tid:%d pid:%d\n", tid, i)
-
-@cython.wraparound(False)
-@cython.boundscheck(False)
-cdef void traverse_beam(int batch_size, int pad_id, int[:, ::1] result, float[::1] score, int dedup) nogil:
-    cdef int i
-    cdef pair[float, SearchNode_pt] node_pair
-    for i in prange(batch_size, nogil=True, schedule="guided"):
-        node_pair = deref(beams[i * SearchBeam.max_pos])[0]
-        score[i] = node_pair.first
-        traverse_beam_single(node_pair.second, i, pad_id, result, dedup)
-
-
-@cython.wraparound(False)
-@cython.boundscheck(False)
-cdef void traverse_beam_single(SearchNode* beam, int batch, int pad_id, int[:, ::1] result, int dedup) nogil:
-    cdef int length = result.shape[1]
-    cdef int pos, i
-
-    pos = length - 1
-    while beam != <SearchBeam.SearchNode*>0:
-        result[batch, pos] = beam.word
-        pos -= 1
-        beam = beam.parent
-    i = 0
-    pos += 1
-    while pos < length:
-        if dedup > 0 and i > 0 and result[batch, i - 1] == result[batch, pos]:
-            pos += 1
+        with self.lock, nogil:
+            if options.score_dtype == SearchBeam.SCORE_FLOAT32:
+                searcher.search(batch_size, output_length_view, dagscores_f32, nextstep_view, logits_view, lm_vocab_view, result_view, score_view, options)
+            else:
+                searcher.search(batch_size, output_length_view, dagscores_16, nextstep_view, logits_view, lm_vocab_view, result_view, score_view, options)
+
+        return self.finish(result, score, pad_id)
+
+    @cython.boundscheck(False)
+    @cython.wraparound(False)
+    def search_csr(self, row_offsets, dagscores, nextstep_idx, logits_idx, output_length, int prelen,
+            float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id, int go_id, int dedup,
+            int no_consecutive_repeat_ngram, int no_repeat_ngram, int recombine=RECOMBINE_NONE,
+            int length_penalty=LENGTH_PENALTY_POWER, result=None, score=None, score_dtype=None):
+        # Same as search, with the candidates of each (batch, pos) in CSR form: they are the entries
+        # [row_offsets[batch * prelen + pos], row_offsets[batch * prelen + pos + 1]) of the flat dagscores, nextstep_idx
+        # and logits_idx, sorted by descending score like the rows of the dense input. Rows may have any length,
+        # candidates pruned beforehand are never visited.
+
+        dagscores = as_array(dagscores)
+        cdef const int[::1] output_length_view = np.ascontiguousarray(as_array(output_length))
+        cdef const int[::1] row_offsets_view = np.ascontiguousarray(as_array(row_offsets))
+        cdef const int[:] nextstep_view = as_array(nextstep_idx)
+        cdef const int[:] logits_view = as_array(logits_idx)
+        cdef int batch_size = output_length_view.shape[0]
+        assert row_offsets_view.shape[0] == batch_size * prelen + 1, "row_offsets should have batch_size * prelen + 1 entries"
+        assert dagscores.shape[0] == nextstep_view.shape[0] == logits_view.shape[0] >= row_offsets_view[batch_size * prelen], \
+            "dagscores, nextstep_idx and logits_idx should have the same length, covering row_offsets"
+        cdef int [::1] lm_vocab_view = self.lm_vocab
+        cdef SearchBeam.DagSearcher* searcher = self.c_searcher
+        cdef SearchBeam.SearchOptions options = make_options(alpha, gamma, beam_size, beamlensize, top_p, pad_id, go_id, dedup,
+            no_consecutive_repeat_ngram, no_repeat_ngram, recombine, length_penalty)
+        options.score_dtype = score_dtype_of(dagscores, score_dtype)
+        cdef const float[:] dagscores_f32
+        cdef const unsigned short[:] dagscores_16
+        if options.score_dtype == SearchBeam.SCORE_FLOAT32:
+            dagscores_f32 = dagscores
         else:
-            result[batch, i] = result[batch, pos]
-            i += 1
-            pos += 1
-    while i < length:
-        result[batch, i] = pad_id
-        i += 1
+            dagscores_16 = dagscores.view(np.uint16)
+
+        result, score = output_arrays(result, score, batch_size, prelen)
+        cdef int[:, :] result_view = result
+        cdef float[:] score_view = score
+
+        with self.lock, nogil:
+            if options.score_dtype == SearchBeam.SCORE_FLOAT32:
+                searcher.search_csr(batch_size, output_length_view, row_offsets_view, dagscores_f32, nextstep_view, logits_view, lm_vocab_view, result_view, score_view, options)
+            else:
+                searcher.search_csr(batch_size, output_length_view, row_offsets_view, dagscores_16, nextstep_view, logits_view, lm_vocab_view, result_view, score_view, options)
+
+        return self.finish(result, score, pad_id)
+
+    def search_async(self, dagscores, nextstep_idx, logits_idx, output_length, *args, **kwargs):
+        # Runs search on a worker thread of this searcher and returns a concurrent.futures.Future of its result.
+        # The arrays are copied first, so the caller may reuse them right away. Poll with future.done(), wait with
+        # future.result(), or await asyncio.wrap_future(future). The searches of one searcher run in submission order.
+        # Output buffers passed as result and score are not copied, they are written when the search runs.
+        return self.submit(self.search, (dagscores, nextstep_idx, logits_idx, output_length), args, kwargs)
+
+    def search_csr_async(self, row_offsets, dagscores, nextstep_idx, logits_idx, output_length, *args, **kwargs):
+        # search_csr on the worker thread, see search_async
+        return self.submit(self.search_csr, (row_offsets, dagscores, nextstep_idx, logits_idx, output_length), args, kwargs)
+
+    def submit(self, method, arrays, args, kwargs):
+        arrays = [np.array(as_array(array), copy=True, order='C') for array in arrays]
+        if self.executor is None:
+            self.executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="dag_search")
+        return self.executor.submit(method, *arrays, *args, **kwargs)
+
+    def finish(self, result, score, int pad_id):
+        global init_time, update_time, expand_time
+        cdef SearchBeam.DagSearcher* searcher = self.c_searcher
+        if SearchBeam.__debug_flag:
+            init_time += searcher.init_time
+            update_time += searcher.get_time
+            expand_time += searcher.get_time + searcher.expand_time
+            print(f"init_time {init_time} update_time {update_time}, expand_time {expand_time}")
+            printf("dag_search: pool memory %.2f MB\n", searcher.pool_allocated_bytes() / 1024. / 1024.)
+            printf("dag_search: lm cache hits %ld / %ld\n", searcher.lm_cache_hits(), searcher.lm_cache_lookups())
+        output_len = (result != pad_id).sum(axis=-1).max()
+        return result[:, :output_len], score
+
+def as_array(data):
+    # numpy arrays and other buffer protocol objects are viewed as they are, DLPack tensors (torch, jax, ...) through
+    # np.from_dlpack. Neither copies, strides are kept.
+    if isinstance(data, np.ndarray):
+        return data
+    if hasattr(data, "__dlpack__"):
+        return np.from_dlpack(data)
+    return np.asarray(data)
+
+def output_arrays(result, score, int batch_size, int prelen):
+    # The caller's buffers cut to (batch_size, prelen), or new arrays. The engine writes result rows through their stride
+    # but expects the tokens of a row next to each other.
+    if result is None:
+        result = np.zeros((batch_size, prelen), dtype=np.intc)
+    else:
+        result = writable_array(result, "result")
+        assert result.dtype == np.intc and result.ndim == 2, "result should be a 2-d int32 array"
+        assert result.shape[0] >= batch_size and result.shape[1] >= prelen, "result should have at least batch_size x prelen entries"
+        result = result[:batch_size, :prelen]
+        assert result.strides[1] == result.itemsize, "the rows of result should be contiguous"
+    if score is None:
+        score = np.zeros((batch_size), dtype=np.float32)
+    else:
+        score = writable_array(score, "score")
+        assert score.dtype == np.float32 and score.ndim == 1 and score.shape[0] >= batch_size, \
+            "score should be a float32 array with at least batch_size entries"
+        score = score[:batch_size]
+    return result, score
+
+def writable_array(data, name):
+    # np.from_dlpack returns read-only arrays for producers of the unversioned DLPack protocol (NumPy < 2.1, older torch).
+    # Such an output buffer is taken through its own __array__ when that shares the memory (torch CPU tensors), it is
+    # never copied since the search writes it in place.
+    array = as_array(data)
+    if not array.flags.writeable and not isinstance(data, np.ndarray) and hasattr(data, "__array__"):
+        shared = np.asarray(data)
+        if shared.flags.writeable and shared.__array_interface__["data"][0] == array.__array_interface__["data"][0] \
+                and shared.shape == array.shape and shared.strides == array.strides:
+            array = shared
+    assert array.flags.writeable, name + " is read-only, pass a writable array (np.from_dlpack exports are read-only before NumPy 2.1)"
+    return array
+
+def score_dtype_of(dagscores, score_dtype=None):
+    # The declared score_dtype, checked against the array, or the one of the array dtype.
+    if score_dtype is None:
+        if dagscores.dtype == np.float16:
+            return SCORE_FLOAT16
+        if dagscores.dtype.name == "bfloat16":
+            return SCORE_BFLOAT16
+        return SCORE_FLOAT32
+    if score_dtype == SCORE_FLOAT32:
+        assert dagscores.dtype == np.float32, "score_dtype SCORE_FLOAT32 needs float32 dagscores"
+    else:
+        assert score_dtype in (SCORE_FLOAT16, SCORE_BFLOAT16), "score_dtype should be SCORE_FLOAT32, SCORE_FLOAT16 or SCORE_BFLOAT16"
+        assert dagscores.dtype.itemsize == 2, "16-bit score_dtype needs dagscores with 16-bit items"
+    return score_dtype
+
+cdef SearchBeam.SearchOptions make_options(float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id,
+        int go_id, int dedup, int no_consecutive_repeat_ngram, int no_repeat_ngram, int recombine, int length_penalty):
+    cdef SearchBeam.SearchOptions options
+    options.alpha = alpha
+    options.gamma = gamma
+    options.top_p = top_p
+    options.beam_size = beam_size
+    options.beamlensize = beamlensize
+    options.pad_id = pad_id
+    options.go_id = go_id
+    options.dedup = dedup
+    options.no_consecutive_repeat_ngram = no_consecutive_repeat_ngram
+    options.no_repeat_ngram = no_repeat_ngram
+    options.recombine = recombine
+    options.length_penalty = length_penalty
+    options.score_dtype = SearchBeam.SCORE_FLOAT32
+    return options
+
+def beam_search_init(int batch_size, int beam_size, int top_cand_n, int maxpos, int maxtoken, int threads_per_worker, tgt_dict, path=None, int pool_reserve=0):
+    # Create the default searcher used by dag_search
+    global default_searcher
+    default_searcher = DagSearcher(batch_size, beam_size, top_cand_n, maxpos, maxtoken, threads_per_worker, tgt_dict, path, pool_reserve)
+
+def dag_search(dagscores, nextstep_idx, logits_idx, output_length,
+        float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id, int go_id, int dedup,
+        int no_consecutive_repeat_ngram, int no_repeat_ngram, int recombine=RECOMBINE_NONE, int length_penalty=LENGTH_PENALTY_POWER,
+        result=None, score=None, score_dtype=None):
+    assert default_searcher is not None, "call beam_search_init first"
+    return default_searcher.search(dagscores, nextstep_idx, logits_idx, output_length, alpha, gamma, beam_size, beamlensize,
+        top_p, pad_id, go_id, dedup, no_consecutive_repeat_ngram, no_repeat_ngram, recombine, length_penalty, result, score, score_dtype)
+
+def dag_search_csr(row_offsets, dagscores, nextstep_idx, logits_idx, output_length, int prelen,
+        float alpha, float gamma, int beam_size, int beamlensize, float top_p, int pad_id, int go_id, int dedup,
+        int no_consecutive_repeat_ngram, int no_repeat_ngram, int recombine=RECOMBINE_NONE, int length_penalty=LENGTH_PENALTY_POWER,
+        result=None, score=None, score_dtype=None):
+    assert default_searcher is not None, "call beam_search_init first"
+    return default_searcher.search_csr(row_offsets, dagscores, nextstep_idx, logits_idx, output_length, prelen, alpha, gamma,
+        beam_size, beamlensize, top_p, pad_id, go_id, dedup, no_consecutive_repeat_ngram, no_repeat_ngram, recombine, length_penalty,
+        result, score, score_dtype)
+
+def dag_search_async(dagscores, nextstep_idx, logits_idx, output_length, *args, **kwargs):
+    # dag_search on a worker thread, returns a concurrent.futures.Future, see DagSearcher.search_async
+    assert default_searcher is not None, "call beam_search_init first"
+    return default_searcher.search_async(dagscores, nextstep_idx, logits_idx, output_length, *args, **kwargs)
@@ -0,0 +1,404 @@
+// Benchmark for the DAG beam search engine without Python, a model or a GPU.
+// Inputs are either recorded tensors (.npy files dumped from DA-Transformer) or synthetic DAGs.
+#include "SearchBeam.h"
+#include "memviewslice.h"
+#include "../util/exception.hh"
+
+#include <boost/program_options.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct NpyArray {
+  std::vector<std::size_t> shape;
+  std::vector<float> floats;
+  std::vector<int> ints;
+
+  std::size_t Size() const {
+    std::size_t res = 1;
+    for (std::size_t d : shape) res *= d;
+    return res;
+  }
+};
+
+// Minimal reader for C-ordered little-endian float32/int32/int64 .npy files.
+NpyArray LoadNpy(const std::string &path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  UTIL_THROW_IF2(!in, "Cannot open " << path);
+  char magic[8];
+  in.read(magic, 8);
+  UTIL_THROW_IF2(!in || std::memcmp(magic, "\x93NUMPY", 6), path << " is not a .npy file");
+  uint32_t header_len = 0;
+  if (magic[6] == 1) {
+    unsigned char len[2];
+    in.read((char*)len, 2);
+    header_len = len[0] | (len[1] << 8);
+  } else {
+    unsigned char len[4];
+    in.read((char*)len, 4);
+    header_len = len[0] | (len[1] << 8) | (len[2] << 16) | ((uint32_t)len[3] << 24);
+  }
+  std::string header(header_len, ' ');
+  in.read(&header[0], header_len);
+
+  std::size_t descr = header.find("'descr'");
+  UTIL_THROW_IF2(descr == std::string::npos, "No descr in header of " << path);
+  std::size_t descr_begin = header.find('\'', header.find(':', descr)) + 1;
+  std::string dtype = header.substr(descr_begin, header.find('\'', descr_begin) - descr_begin);
+  UTIL_THROW_IF2(header.find("'fortran_order': True") != std::string::npos, path << " is fortran ordered");
+
+  NpyArray res;
+  std::size_t shape_begin = header.find('(', header.find("'shape'")) + 1;
+  std::stringstream shape(header.substr(shape_begin, header.find(')', shape_begin) - shape_begin));
+  std::string dim;
+  while (std::getline(shape, dim, ',')) {
+    if (dim.find_first_not_of(' ') != std::string::npos) res.shape.push_back(std::stoul(dim));
+  }
+
+  std::size_t size = res.Size();
+  if (dtype == "<f4") {
+    res.floats.resize(size);
+    in.read((char*)res.floats.data(), size * sizeof(float));
+  } else if (dtype == "<i4") {
+    res.ints.resize(size);
+    in.read((char*)res.ints.data(), size * sizeof(int));
+  } else if (dtype == "<i8") {
+    std::vector<int64_t> buf(size);
+    in.read((char*)buf.data(), size * sizeof(int64_t));
+    res.ints.assign(buf.begin(), buf.end());
+  } else {
+    UTIL_THROW(util::Exception, "Unsupported dtype " << dtype << " in " << path);
+  }
+  UTIL_THROW_IF2(!in, "Truncated file " << path);
+  return res;
+}
+
+// One batch of search inputs, laid out like the contiguous arrays dag_search receives.
+struct DagInput {
+  int batch_size, prelen, top_cand_n;
+  std::vector<float> dagscores;
+  std::vector<int> nextstep_idx, logits_idx, output_length;
+};
+
+// Random DAG: every vertex links to the next few vertices, candidate probabilities are sorted like topk output.
+DagInput SyntheticInput(int batch_size, int prelen, int top_cand_n, int vocab_size, float min_length_ratio, std::mt19937 &gen) {
+  DagInput res;
+  res.batch_size = batch_size;
+  res.prelen = prelen;
+  res.top_cand_n = top_cand_n;
+  res.dagscores.resize((std::size_t)batch_size * prelen * top_cand_n);
+  res.nextstep_idx.resize(res.dagscores.size());
+  res.logits_idx.resize(res.dagscores.size());
+  std::uniform_int_distribution<int> length_dist(std::max(2, (int)(prelen * min_length_ratio)), std::max(2, prelen));
+  std::uniform_int_distribution<int> jump_dist(0, 3), word_dist(0, vocab_size - 1);
+  std::exponential_distribution<float> prob_dist(1.0);
+  std::vector<float> probs(top_cand_n);
+  for (int b = 0; b < batch_size; ++b) {
+    int length = std::min(length_dist(gen), prelen);
+    res.output_length.push_back(length);
+    for (int i = 0; i < prelen; ++i) {
+      float sum = 0;
+      for (float &p : probs) sum += (p = prob_dist(gen));
+      std::sort(probs.begin(), probs.end(), std::greater<float>());
+      std::size_t offset = ((std::size_t)b * prelen + i) * top_cand_n;
+      for (int j = 0; j < top_cand_n; ++j) {
+        res.dagscores[offset + j] = std::log(probs[j] / sum);
+        res.nextstep_idx[offset + j] = std::min(i + 1 + jump_dist(gen), std::max(length - 1, i + 1));
+        res.logits_idx[offset + j] = word_dist(gen);
+      }
+    }
+  }
+  return res;
+}
+
+// Recorded tensors, with batch rows repeated cyclically to reach batch_size.
+DagInput RecordedInput(const std::string &dir, int batch_size) {
+  NpyArray dagscores = LoadNpy(dir + "/dagscores.npy");
+  NpyArray nextstep_idx = LoadNpy(dir + "/nextstep_idx.npy");
+  NpyArray logits_idx = LoadNpy(dir + "/logits_idx.npy");
+  NpyArray output_length = LoadNpy(dir + "/output_length.npy");
+  UTIL_THROW_IF2(dagscores.shape.size() != 3 || dagscores.floats.empty(), "dagscores.npy should be float32 [batch, prelen, top_cand_n]");
+  UTIL_THROW_IF2(nextstep_idx.shape != dagscores.shape || logits_idx.shape != dagscores.shape, "nextstep_idx/logits_idx shapes differ from dagscores");
+  UTIL_THROW_IF2(output_length.ints.size() != dagscores.shape[0], "output_length.npy should have one entry per batch item");
+
+  DagInput res;
+  int recorded_batch = dagscores.shape[0];
+  res.batch_size = batch_size > 0 ? batch_size : recorded_batch;
+  res.prelen = dagscores.shape[1];
+  res.top_cand_n = dagscores.shape[2];
+  std::size_t row = (std::size_t)res.prelen * res.top_cand_n;
+  for (int b = 0; b < res.batch_size; ++b) {
+    int from = b % recorded_batch;
+    res.dagscores.insert(res.dagscores.end(), dagscores.floats.begin() + from * row, dagscores.floats.begin() + (from + 1) * row);
+    res.nextstep_idx.insert(res.nextstep_idx.end(), nextstep_idx.ints.begin() + from * row, nextstep_idx.ints.begin() + (from + 1) * row);
+    res.logits_idx.insert(res.logits_idx.end(), logits_idx.ints.begin() + from * row, logits_idx.ints.begin() + (from + 1) * row);
+    res.output_length.push_back(output_length.ints[from]);
+  }
+  return res;
+}
+
+__Pyx_memviewslice MakeView(const void *data, std::size_t item_size, std::vector<std::size_t> shape) {
+  __Pyx_memviewslice res;
+  std::memset(&res, 0, sizeof(res));
+  res.data = (char*)data;
+  Py_ssize_t stride = item_size;
+  for (int d = shape.size() - 1; d >= 0; --d) {
+    res.shape[d] = shape[d];
+    res.strides[d] = stride;
+    stride *= shape[d];
+  }
+  return res;
+}
+
+// CSR form of a dense input for DagSearcher::search_csr. Rows past the output length are empty, and with prune only the
+// candidates within top_p are kept, which matches the dense search as long as no repeat blocking is used.
+struct CsrInput {
+  std::vector<int> row_offsets, nextstep_idx, logits_idx;
+  std::vector<float> dagscores;
+};
+
+CsrInput ToCsr(const DagInput &input, bool prune, float top_p) {
+  CsrInput res;
+  res.row_offsets.push_back(0);
+  for (int b = 0; b < input.batch_size; ++b) {
+    for (int pos = 0; pos < input.prelen; ++pos) {
+      std::size_t row = ((std::size_t)b * input.prelen + pos) * input.top_cand_n;
+      int count = pos < input.output_length[b] ? input.top_cand_n : 0;
+      if (prune && count) {
+        float sum = 0;
+        for (count = 0; count < input.top_cand_n && sum < top_p; ++count) sum += std::exp(input.dagscores[row + count]);
+      }
+      res.dagscores.insert(res.dagscores.end(), input.dagscores.begin() + row, input.dagscores.begin() + row + count);
+      res.nextstep_idx.insert(res.nextstep_idx.end(), input.nextstep_idx.begin() + row, input.nextstep_idx.begin() + row + count);
+      res.logits_idx.insert(res.logits_idx.end(), input.logits_idx.begin() + row, input.logits_idx.begin() + row + count);
+      res.row_offsets.push_back(res.dagscores.size());
+    }
+  }
+  return res;
+}
+
+// Empty for SCORE_FLOAT32
+std::vector<uint16_t> ToScoreDtype(const std::vector<float> &scores, int score_dtype) {
+  std::vector<uint16_t> res;
+  if (score_dtype == SCORE_FLOAT32) return res;
+  res.reserve(scores.size());
+  for (float score : scores) res.push_back(score_dtype == SCORE_FLOAT16 ? float_to_half(score).bits : float_to_bfloat16(score).bits);
+  return res;
+}
+
+struct SearchConfig {
+  int beam_size, beamlensize, threads, lm_vocab_size;
+  float alpha, gamma, top_p;
+  int no_consecutive_repeat_ngram, no_repeat_ngram, recombine, length_penalty, score_dtype;
+  int repeat;
+  bool phases, virtual_lm, csr;
+  std::string lm_path;
+};
+
+struct PhaseTimes {
+  double init, get, expand, traverse;
+  long nodes, lm_hits, lm_lookups;
+};
+
+PhaseTimes RunSearch(const DagInput &input, const SearchConfig &config, const std::vector<int> &lm_vocab) {
+  std::vector<char> lm_path(config.lm_path.begin(), config.lm_path.end());
+  lm_path.push_back(0);
+  DagSearcher searcher(input.batch_size, config.beam_size, input.top_cand_n, input.prelen, input.batch_size * input.prelen,
+      config.threads, 0, config.lm_path.empty() ? nullptr : lm_path.data());
+  if (config.virtual_lm && searcher.model) searcher.lm_score_pending = lm_virtual_score_pending;
+
+  std::size_t batch = input.batch_size, prelen = input.prelen, top_cand_n = input.top_cand_n;
+  __Pyx_memviewslice output_length = MakeView(input.output_length.data(), sizeof(int), {batch});
+  // 16-bit dagscores are rounded from the float ones, so they only match the float search up to the rounding
+  std::vector<uint16_t> dagscores16 = ToScoreDtype(input.dagscores, config.score_dtype);
+  __Pyx_memviewslice dagscores = config.score_dtype == SCORE_FLOAT32
+    ? MakeView(input.dagscores.data(), sizeof(float), {batch, prelen, top_cand_n})
+    : MakeView(dagscores16.data(), sizeof(uint16_t), {batch, prelen, top_cand_n});
+  __Pyx_memviewslice nextstep_idx = MakeView(input.nextstep_idx.data(), sizeof(int), {batch, prelen, top_cand_n});
+  __Pyx_memviewslice logits_idx = MakeView(input.logits_idx.data(), sizeof(int), {batch, prelen, top_cand_n});
+  __Pyx_memviewslice lm_vocab_view = MakeView(lm_vocab.data(), sizeof(int), {lm_vocab.size()});
+  std::vector<int> result(batch * prelen);
+  std::vector<float> score(batch);
+  __Pyx_memviewslice result_view = MakeView(result.data(), sizeof(int), {batch, prelen});
+  __Pyx_memviewslice score_view = MakeView(score.data(), sizeof(float), {batch});
+  CsrInput csr;
+  if (config.csr) csr = ToCsr(input, config.no_consecutive_repeat_ngram == 0 && config.no_repeat_ngram == 0, config.top_p);
+  __Pyx_memviewslice row_offsets = MakeView(csr.row_offsets.data(), sizeof(int), {csr.row_offsets.size()});
+  std::vector<uint16_t> csr_dagscores16 = ToScoreDtype(csr.dagscores, config.score_dtype);
+  __Pyx_memviewslice csr_dagscores = config.score_dtype == SCORE_FLOAT32
+    ? MakeView(csr.dagscores.data(), sizeof(float), {csr.dagscores.size()})
+    : MakeView(csr_dagscores16.data(), sizeof(uint16_t), {csr.dagscores.size()});
+  __Pyx_memviewslice csr_nextstep_idx = MakeView(csr.nextstep_idx.data(), sizeof(int), {csr.nextstep_idx.size()});
+  __Pyx_memviewslice csr_logits_idx = MakeView(csr.logits_idx.data(), sizeof(int), {csr.logits_idx.size()});
+
+  SearchOptions options;
+  options.alpha = config.alpha;
+  options.gamma = config.gamma;
+  options.top_p = config.top_p;
+  options.beam_size = config.beam_size;
+  options.beamlensize = config.beamlensize;
+  options.pad_id = 0;
+  options.go_id = 1;
+  options.dedup = 0;
+  options.no_consecutive_repeat_ngram = config.no_consecutive_repeat_ngram;
+  options.no_repeat_ngram = config.no_repeat_ngram;
+  options.recombine = config.recombine;
+  options.length_penalty = config.length_penalty;
+  options.score_dtype = config.score_dtype;
+
+  PhaseTimes times = {0, 0, 0, 0, 0, 0, 0};
+  // The first run warms up the pools and is not measured.
+  for (int run = 0; run <= config.repeat; ++run) {
+    if (!config.phases) {
+      if (config.csr) {
+        searcher.search_csr(input.batch_size, output_length, row_offsets, csr_dagscores, csr_nextstep_idx, csr_logits_idx, lm_vocab_view,
+            result_view, score_view, options);
+      } else {
+        searcher.search(input.batch_size, output_length, dagscores, nextstep_idx, logits_idx, lm_vocab_view, result_view, score_view, options);
+      }
+      if (run == 0) continue;
+      times.init += searcher.init_time;
+      times.get += searcher.get_time;
+      times.expand += searcher.expand_time;
+      times.traverse += searcher.traverse_time;
+      times.nodes += searcher.nodes_created();
+      times.lm_hits += searcher.lm_cache_hits();
+      times.lm_lookups += searcher.lm_cache_lookups();
+      continue;
+    }
+    double start = omp_get_wtime();
+    searcher.init_beam(input.batch_size, 1);
+    double after_init = omp_get_wtime(), get = 0, expand = 0;
+    int steps = searcher.search_steps(input.batch_size, input.output_length.data(), input.prelen);
+    for (int step = 0; step < steps; ++step) {
+      double before_get = omp_get_wtime();
+      searcher.get_beam(input.batch_size, step, output_length, config.alpha, config.gamma, config.beam_size, config.beamlensize, config.recombine, config.length_penalty);
+      double before_expand = omp_get_wtime();
+      searcher.expand_beam(input.batch_size, step, output_length, dagscores, nextstep_idx, logits_idx, lm_vocab_view,
+          config.top_p, config.no_consecutive_repeat_ngram, config.no_repeat_ngram, config.score_dtype);
+      double after_expand = omp_get_wtime();
+      get += before_expand - before_get;
+      expand += after_expand - before_expand;
+    }
+    double before_traverse = omp_get_wtime();
+    searcher.traverse_beam(input.batch_size, 0, result_view, score_view, 0);
+    double end = omp_get_wtime();
+    if (run == 0) continue;
+    times.init += after_init - start;
+    times.get += get;
+    times.expand += expand;
+    times.traverse += end - before_traverse;
+    times.nodes += searcher.nodes_created();
+    times.lm_hits += searcher.lm_cache_hits();
+    times.lm_lookups += searcher.lm_cache_lookups();
+  }
+  return times;
+}
+
+std::vector<int> ParseList(const std::string &str) {
+  std::vector<int> res;
+  std::stringstream stream(str);
+  std::string item;
+  while (std::getline(stream, item, ',')) res.push_back(std::stoi(item));
+  UTIL_THROW_IF2(res.empty(), "Empty list " << str);
+  return res;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    SearchConfig config;
+    std::string input_dir, lm_vocab_path, batch_list, prelen_list, top_cand_list, beam_list, beamlen_list, thread_list;
+    int vocab_size, seed;
+    float min_length_ratio;
+    namespace po = boost::program_options;
+    po::options_description options("DAG search benchmark options");
+    options.add_options()
+      ("help,h", po::bool_switch(), "Show help message")
+      ("input,i", po::value<std::string>(&input_dir), "Directory with recorded dagscores.npy, nextstep_idx.npy, logits_idx.npy and output_length.npy. Synthetic DAGs are generated if omitted")
+      ("lm,m", po::value<std::string>(&config.lm_path), "KenLM model (arpa or binary). No LM if omitted")
+      ("lm_vocab", po::value<std::string>(&lm_vocab_path), "int32 .npy mapping target word ids to LM word ids. Otherwise word ids are mapped to LM ids modulo --lm_vocab_size")
+      ("lm_vocab_size", po::value<int>(&config.lm_vocab_size)->default_value(1), "Number of LM words (ngram 1= in the ARPA header) used for synthetic word ids")
+      ("batch,b", po::value<std::string>(&batch_list)->default_value("32"), "Comma-separated batch sizes (recorded rows are repeated or truncated)")
+      ("prelen,p", po::value<std::string>(&prelen_list)->default_value("200"), "Comma-separated graph lengths (synthetic only)")
+      ("topk,k", po::value<std::string>(&top_cand_list)->default_value("5"), "Comma-separated top_cand_n (synthetic only)")
+      ("beam", po::value<std::string>(&beam_list)->default_value("64"), "Comma-separated beam sizes")
+      ("beamlen", po::value<std::string>(&beamlen_list)->default_value("16"), "Comma-separated beam sizes per length")
+      ("threads,t", po::value<std::string>(&thread_list)->default_value("1"), "Comma-separated thread counts")
+      ("vocab", po::value<int>(&vocab_size)->default_value(32000), "Target vocabulary size")
+      ("min_length_ratio", po::value<float>(&min_length_ratio)->default_value(0.3), "Synthetic output lengths are uniform in [ratio * prelen, prelen]")
+      ("alpha", po::value<float>(&config.alpha)->default_value(1.1), "Length penalty")
+      ("gamma", po::value<float>(&config.gamma)->default_value(0.1), "LM weight")
+      ("top_p", po::value<float>(&config.top_p)->default_value(0.9), "Candidate cumulative probability cutoff")
+      ("no_consecutive_repeat_ngram", po::value<int>(&config.no_consecutive_repeat_ngram)->default_value(0), "Block consecutive repeated n-grams")
+      ("no_repeat_ngram", po::value<int>(&config.no_repeat_ngram)->default_value(0), "Block repeated n-grams")
+      ("recombine", po::value<int>(&config.recombine)->default_value(RECOMBINE_NONE), "Hypothesis recombination: 0 none, 1 max, 2 logsumexp")
+      ("virtual_lm", po::bool_switch(&config.virtual_lm), "Score LM transitions through the virtual lm::base::Model interface instead of the concrete model type")
+      ("length_penalty", po::value<int>(&config.length_penalty)->default_value(LENGTH_PENALTY_POWER), "Length normalization: 0 length^alpha, 1 GNMT ((5 + length) / 6)^alpha")
+      ("score_dtype", po::value<int>(&config.score_dtype)->default_value(SCORE_FLOAT32), "Element type of dagscores: 0 float32, 1 float16, 2 bfloat16")
+      ("csr", po::bool_switch(&config.csr), "Pass the DAG to search_csr, keeping only the candidates within top_p unless repeats are blocked")
+      ("phases", po::bool_switch(&config.phases), "Call init_beam/get_beam/expand_beam/traverse_beam separately, each in its own parallel region, instead of search")
+      ("repeat,r", po::value<int>(&config.repeat)->default_value(3), "Measured runs per configuration")
+      ("seed", po::value<int>(&seed)->default_value(1), "Seed for synthetic DAGs");
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    if (vm["help"].as<bool>()) {
+      std::cerr << options << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+    UTIL_THROW_IF2(config.repeat <= 0, "--repeat should be positive");
+    UTIL_THROW_IF2(config.csr && config.phases, "--csr only runs the whole search");
+
+    std::cout << "batch\tprelen\ttopk\tbeam\tbeamlen\tthreads\tinit_ms\tget_ms\texpand_ms\ttraverse_ms\ttotal_ms\tnodes\tlm_hit%\tsent/s" << std::endl;
+    std::vector<int> lm_vocab(vocab_size);
+    if (!lm_vocab_path.empty()) {
+      lm_vocab = LoadNpy(lm_vocab_path).ints;
+      vocab_size = lm_vocab.size();
+    } else {
+      for (int i = 0; i < vocab_size; ++i) lm_vocab[i] = i % config.lm_vocab_size;
+    }
+    std::mt19937 gen(seed);
+    for (int batch : ParseList(batch_list)) {
+      for (int prelen : input_dir.empty() ? ParseList(prelen_list) : std::vector<int>(1, 0)) {
+        for (int top_cand_n : input_dir.empty() ? ParseList(top_cand_list) : std::vector<int>(1, 0)) {
+          DagInput input = input_dir.empty() ?
+            SyntheticInput(batch, prelen, top_cand_n, vocab_size, min_length_ratio, gen) : RecordedInput(input_dir, batch);
+          for (int word : input.logits_idx) UTIL_THROW_IF2(word < 0 || word >= vocab_size, "Word id " << word << " out of --vocab range");
+          for (int beam : ParseList(beam_list)) {
+            config.beam_size = beam;
+            for (int beamlen : ParseList(beamlen_list)) {
+              config.beamlensize = beamlen;
+              for (int threads : ParseList(thread_list)) {
+                config.threads = threads;
+                PhaseTimes times = RunSearch(input, config, lm_vocab);
+                double scale = 1000.0 / config.repeat;
+                double total = times.init + times.get + times.expand + times.traverse;
+                std::cout << std::fixed << std::setprecision(2)
+                  << input.batch_size << '\t' << input.prelen << '\t' << input.top_cand_n << '\t' << beam << '\t' << beamlen << '\t' << threads << '\t'
+                  << times.init * scale << '\t' << times.get * scale << '\t' << times.expand * scale << '\t' << times.traverse * scale << '\t'
+                  << total * scale << '\t' << times.nodes / config.repeat << '\t' << 100.0 * times.lm_hits / std::max(times.lm_lookups, 1L) << '\t'
+                  << input.batch_size * config.repeat / total << std::endl;
+              }
+            }
+          }
+        }
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,411 @@
+#include "SearchBeam.h"
+#include "memviewslice.h"
+
+#define BOOST_TEST_MODULE DagSearchTest
+#include <boost/test/unit_test.hpp>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Target vocabulary of the tests: ids 0-2 are <pad> <s> </s>, then words of test.arpa, then words it does not know.
+const char *kWords[] = {"<pad>", "<s>", "</s>", "a", "the", "is", "little", "more", "look", "watch", "in", "zzunk1", "zzunk2"};
+const int kVocabSize = sizeof(kWords) / sizeof(kWords[0]);
+const int kPad = 0, kGo = 1, kLittle = 6, kUnk1 = 11, kUnk2 = 12;
+
+char *ArpaPath() {
+  BOOST_REQUIRE(boost::unit_test::framework::master_test_suite().argc >= 2);
+  return boost::unit_test::framework::master_test_suite().argv[1];
+}
+
+__Pyx_memviewslice MakeView(const void *data, std::size_t item_size, std::vector<std::size_t> shape) {
+  __Pyx_memviewslice res;
+  std::memset(&res, 0, sizeof(res));
+  res.data = (char*)data;
+  Py_ssize_t stride = item_size;
+  for (int d = shape.size() - 1; d >= 0; --d) {
+    res.shape[d] = shape[d];
+    res.strides[d] = stride;
+    stride *= shape[d];
+  }
+  return res;
+}
+
+// A dense DAG: candidate k of (batch b, position i) goes to nextstep with word and log probability score.
+struct Dag {
+  Dag(int batch_size, int prelen, int top_cand_n)
+    : batch_size(batch_size), prelen(prelen), top_cand_n(top_cand_n),
+      dagscores(batch_size * prelen * top_cand_n, -30.0f), nextstep_idx(batch_size * prelen * top_cand_n, prelen - 1),
+      logits_idx(batch_size * prelen * top_cand_n, kPad), output_length(batch_size, prelen) {}
+
+  void Set(int b, int i, int k, int nextstep, int word, float score) {
+    std::size_t at = ((std::size_t)b * prelen + i) * top_cand_n + k;
+    nextstep_idx[at] = nextstep;
+    logits_idx[at] = word;
+    dagscores[at] = score;
+  }
+
+  int batch_size, prelen, top_cand_n;
+  std::vector<float> dagscores;
+  std::vector<int> nextstep_idx, logits_idx, output_length;
+};
+
+// Random DAG over the words of kWords, candidates sorted by descending score like the model output.
+Dag RandomDag(std::mt19937 &gen, int batch_size, int prelen, int top_cand_n) {
+  Dag dag(batch_size, prelen, top_cand_n);
+  std::uniform_int_distribution<int> word(3, kVocabSize - 1), jump(1, 3), length(2, prelen);
+  std::gamma_distribution<float> weight(0.5f, 1.0f);
+  for (int b = 0; b < batch_size; ++b) {
+    dag.output_length[b] = length(gen);
+    for (int i = 0; i < prelen; ++i) {
+      std::vector<float> probs(top_cand_n);
+      float sum = 0;
+      for (float &p : probs) sum += (p = weight(gen) + 1e-6f);
+      std::sort(probs.begin(), probs.end(), [](float a, float c) { return a > c; });
+      for (int k = 0; k < top_cand_n; ++k) {
+        int last = std::max(dag.output_length[b] - 1, i + 1);
+        dag.Set(b, i, k, std::min(i + jump(gen), last), word(gen), std::log(probs[k] / sum));
+      }
+    }
+  }
+  return dag;
+}
+
+// CSR form of a Dag for DagSearcher::search_csr. Rows past the output length are empty, and with prune only the
+// candidates within top_p are kept, so rows have different lengths.
+struct CsrDag {
+  CsrDag(const Dag &dag, bool prune, float top_p) {
+    row_offsets.push_back(0);
+    for (int b = 0; b < dag.batch_size; ++b) {
+      for (int pos = 0; pos < dag.prelen; ++pos) {
+        std::size_t row = ((std::size_t)b * dag.prelen + pos) * dag.top_cand_n;
+        int count = pos < dag.output_length[b] ? dag.top_cand_n : 0;
+        if (prune && count) {
+          float sum = 0;
+          for (count = 0; count < dag.top_cand_n && sum < top_p; ++count) sum += std::exp(dag.dagscores[row + count]);
+        }
+        dagscores.insert(dagscores.end(), dag.dagscores.begin() + row, dag.dagscores.begin() + row + count);
+        nextstep_idx.insert(nextstep_idx.end(), dag.nextstep_idx.begin() + row, dag.nextstep_idx.begin() + row + count);
+        logits_idx.insert(logits_idx.end(), dag.logits_idx.begin() + row, dag.logits_idx.begin() + row + count);
+        row_offsets.push_back(dagscores.size());
+      }
+    }
+  }
+
+  std::vector<int> row_offsets, nextstep_idx, logits_idx;
+  std::vector<float> dagscores;
+};
+
+SearchOptions Options(int recombine) {
+  SearchOptions options;
+  options.alpha = 1.0f;
+  options.gamma = 0.3f;
+  options.top_p = 0.9f;
+  options.beam_size = 256;
+  options.beamlensize = 256;
+  options.pad_id = kPad;
+  options.go_id = kGo;
+  options.dedup = 0;
+  options.no_consecutive_repeat_ngram = 0;
+  options.no_repeat_ngram = 0;
+  options.recombine = recombine;
+  options.length_penalty = LENGTH_PENALTY_POWER;
+  options.score_dtype = SCORE_FLOAT32;
+  return options;
+}
+
+struct Output {
+  std::vector<int> result;
+  std::vector<float> score;
+};
+
+// Searches the whole batch, the searcher is sized for this input with room for every hypothesis.
+class Searcher {
+  public:
+    Searcher(const Dag &dag, char *lm_path, int beam_size = 256, int vocab_size = kVocabSize, int thread_num = 2)
+      : searcher_(dag.batch_size, beam_size, dag.top_cand_n, dag.prelen, dag.batch_size * dag.prelen, thread_num, 0, lm_path),
+        lm_vocab_(vocab_size, 0) {
+      if (lm_path) {
+        for (int i = 0; i < vocab_size; ++i) lm_vocab_[i] = searcher_.query_vocab_index((char*)kWords[i]);
+      }
+    }
+
+    Output Search(const Dag &dag, const SearchOptions &options) {
+      std::size_t batch = dag.batch_size, prelen = dag.prelen, top_cand_n = dag.top_cand_n;
+      Output out;
+      out.result.resize(batch * prelen);
+      out.score.resize(batch);
+      searcher_.search(dag.batch_size, MakeView(dag.output_length.data(), sizeof(int), {batch}),
+          MakeView(dag.dagscores.data(), sizeof(float), {batch, prelen, top_cand_n}),
+          MakeView(dag.nextstep_idx.data(), sizeof(int), {batch, prelen, top_cand_n}),
+          MakeView(dag.logits_idx.data(), sizeof(int), {batch, prelen, top_cand_n}),
+          MakeView(lm_vocab_.data(), sizeof(int), {lm_vocab_.size()}),
+          MakeView(out.result.data(), sizeof(int), {batch, prelen}), MakeView(out.score.data(), sizeof(float), {batch}), options);
+      return out;
+    }
+
+    Output SearchCsr(const Dag &dag, const CsrDag &csr, const SearchOptions &options) {
+      std::size_t batch = dag.batch_size, prelen = dag.prelen, entries = csr.dagscores.size();
+      Output out;
+      out.result.resize(batch * prelen);
+      out.score.resize(batch);
+      searcher_.search_csr(dag.batch_size, MakeView(dag.output_length.data(), sizeof(int), {batch}),
+          MakeView(csr.row_offsets.data(), sizeof(int), {csr.row_offsets.size()}),
+          MakeView(csr.dagscores.data(), sizeof(float), {entries}),
+          MakeView(csr.nextstep_idx.data(), sizeof(int), {entries}),
+          MakeView(csr.logits_idx.data(), sizeof(int), {entries}),
+          MakeView(lm_vocab_.data(), sizeof(int), {lm_vocab_.size()}),
+          MakeView(out.result.data(), sizeof(int), {batch, prelen}), MakeView(out.score.data(), sizeof(float), {batch}), options);
+      return out;
+    }
+
+  private:
+    DagSearcher searcher_;
+    std::vector<int> lm_vocab_;
+};
+
+// <s> zzunk1 little and <s> zzunk2 little: both unknown words leave the LM in the same state at position 1, so the
+// two hypotheses are recombined there.
+Dag MergingDag() {
+  Dag dag(1, 3, 2);
+  dag.Set(0, 0, 0, 1, kUnk1, std::log(0.6f));
+  dag.Set(0, 0, 1, 1, kUnk2, std::log(0.4f));
+  dag.Set(0, 1, 0, 2, kLittle, 0.0f);
+  return dag;
+}
+
+BOOST_AUTO_TEST_CASE(RecombineMerged) {
+  Dag dag = MergingDag();
+  Searcher searcher(dag, ArpaPath());
+  SearchOptions options = Options(RECOMBINE_NONE);
+  options.alpha = 0; // scores are the plain path log probabilities
+  options.gamma = 0;
+  const std::vector<int> expected = {kGo, kUnk1, kLittle};
+
+  Output none = searcher.Search(dag, options);
+  BOOST_CHECK(none.result == expected);
+  BOOST_CHECK_CLOSE(std::log(0.6f), none.score[0], 1e-4);
+
+  options.recombine = RECOMBINE_MAX;
+  Output max = searcher.Search(dag, options);
+  BOOST_CHECK(max.result == expected);
+  BOOST_CHECK_EQUAL(none.score[0], max.score[0]);
+
+  // the survivor carries the mass of both paths, log(0.6 + 0.4)
+  options.recombine = RECOMBINE_LOGSUMEXP;
+  Output logsumexp = searcher.Search(dag, options);
+  BOOST_CHECK(logsumexp.result == expected);
+  BOOST_CHECK_SMALL(logsumexp.score[0], 1e-5f);
+}
+
+// With beams large enough to keep every hypothesis, MAX only drops hypotheses that can never overtake the one they
+// are merged into, so the result is the one without recombination. LOGSUMEXP adds mass, its best score is not lower.
+BOOST_AUTO_TEST_CASE(RecombineExhaustive) {
+  std::mt19937 gen(1);
+  for (int round = 0; round < 20; ++round) {
+    Dag dag = RandomDag(gen, 4, 7, 2);
+    Searcher searcher(dag, ArpaPath());
+    Output none = searcher.Search(dag, Options(RECOMBINE_NONE));
+    Output max = searcher.Search(dag, Options(RECOMBINE_MAX));
+    Output logsumexp = searcher.Search(dag, Options(RECOMBINE_LOGSUMEXP));
+    BOOST_CHECK(none.result == max.result);
+    for (int b = 0; b < dag.batch_size; ++b) {
+      BOOST_CHECK_EQUAL(none.score[b], max.score[b]);
+      BOOST_CHECK_GE(logsumexp.score[b], none.score[b] - 1e-5f);
+    }
+  }
+}
+
+// Rows padded past their real candidates, with word ids outside the vocabulary: the padding is never within top_p,
+// so it must not be read beyond its own row.
+BOOST_AUTO_TEST_CASE(PaddedCandidates) {
+  Dag dag = MergingDag();
+  for (int k = 1; k < dag.top_cand_n; ++k) dag.Set(0, 1, k, -1, 1 << 30, -INFINITY);
+  Searcher searcher(dag, ArpaPath());
+  SearchOptions options = Options(RECOMBINE_NONE);
+  Output out = searcher.Search(dag, options);
+  BOOST_CHECK(out.result == std::vector<int>({kGo, kUnk1, kLittle}));
+}
+
+// Rows from the last position of a finished item on are padding with word ids outside the vocabulary, while a longer
+// item of the batch still expands. They must not be read, in the dense and in the CSR form.
+BOOST_AUTO_TEST_CASE(PaddedFinishedRows) {
+  std::mt19937 gen(5);
+  Dag dag = RandomDag(gen, 2, 8, 4);
+  dag.output_length = {3, 8};
+  for (int b = 0; b < dag.batch_size; ++b)
+    for (int i = 0; i < dag.prelen; ++i)
+      for (int k = 0; k < dag.top_cand_n; ++k)
+        dag.nextstep_idx[(b * dag.prelen + i) * dag.top_cand_n + k] = std::min(i + 1 + k % 2, dag.output_length[b] - 1);
+  Searcher searcher(dag, ArpaPath());
+  SearchOptions options = Options(RECOMBINE_MAX);
+  Output expected = searcher.Search(dag, options);
+  for (int i = 2; i < dag.prelen; ++i)
+    for (int k = 0; k < dag.top_cand_n; ++k) dag.Set(0, i, k, -1, 1 << 30, 0.0f);
+  Output dense = searcher.Search(dag, options);
+  Output sparse = searcher.SearchCsr(dag, CsrDag(dag, false, options.top_p), options);
+  BOOST_CHECK(dense.result == expected.result);
+  BOOST_CHECK(dense.score == expected.score);
+  BOOST_CHECK(sparse.result == expected.result);
+  BOOST_CHECK(sparse.score == expected.score);
+}
+
+// The words banned after words[0..len] (words[0] is <s>), as the search found them by walking the parents of a node
+// before the blocking used rolling hashes over HistoryChunk.
+std::vector<int> ReferenceBanned(const std::vector<int> &words, int no_consecutive_repeat_ngram, int no_repeat_ngram) {
+  int len = words.size() - 1;
+  std::vector<int> banned;
+  if (no_consecutive_repeat_ngram > 0) banned.push_back(words[len]);
+  for (int prev = len - 1, dist = 1; prev >= 0; --prev, ++dist) {
+    if (words[prev] != words[len]) continue;
+    int match = 1;
+    for (int a = len - 1, b = prev - 1; a >= 0 && b >= 0 && words[a] == words[b]; --a, --b) ++match;
+    if (no_consecutive_repeat_ngram >= dist && match + 1 >= dist) banned.push_back(words[prev + 1]);
+    if (no_repeat_ngram > 0 && no_repeat_ngram <= match + 1) banned.push_back(words[prev + 1]);
+  }
+  return banned;
+}
+
+struct ReferenceResult {
+  std::vector<int> words;
+  float score;
+};
+
+// Every hypothesis of batch b of a chain DAG (candidates of position i go to i + 1) with its candidates chosen the
+// way expand_beam does, keeping the best complete one. With alpha = gamma = 0 the score is the sum of the dagscores.
+void ReferenceSearch(const Dag &dag, int b, const SearchOptions &options, std::vector<int> &words, float score, ReferenceResult &best) {
+  int pos = words.size() - 1;
+  if (pos == dag.output_length[b] - 1) {
+    if (score > best.score) best = {words, score};
+    return;
+  }
+  std::vector<int> banned = ReferenceBanned(words, options.no_consecutive_repeat_ngram, options.no_repeat_ngram);
+  float count_sum = 0;
+  for (int k = 0; k < dag.top_cand_n && count_sum < options.top_p; ++k) {
+    std::size_t at = ((std::size_t)b * dag.prelen + pos) * dag.top_cand_n + k;
+    if (std::find(banned.begin(), banned.end(), dag.logits_idx[at]) != banned.end()) continue;
+    count_sum += std::exp(dag.dagscores[at]);
+    words.push_back(dag.logits_idx[at]);
+    ReferenceSearch(dag, b, options, words, score + dag.dagscores[at], best);
+    words.pop_back();
+  }
+}
+
+void CheckRepeatBlocking(const Dag &dag, int vocab_size, float top_p) {
+  Searcher searcher(dag, nullptr, 4096, vocab_size);
+  for (int consecutive = 0; consecutive < 2; ++consecutive) {
+    for (int n = 1; n <= 4; ++n) {
+      SearchOptions options = Options(RECOMBINE_NONE);
+      options.alpha = 0;
+      options.gamma = 0;
+      options.top_p = top_p;
+      options.beam_size = options.beamlensize = 4096;
+      (consecutive ? options.no_consecutive_repeat_ngram : options.no_repeat_ngram) = n;
+      Output out = searcher.Search(dag, options);
+      for (int b = 0; b < dag.batch_size; ++b) {
+        ReferenceResult best = {std::vector<int>(), -INFINITY};
+        std::vector<int> words(1, kGo);
+        ReferenceSearch(dag, b, options, words, 0, best);
+        best.words.resize(dag.prelen, kPad);
+        BOOST_TEST_CONTEXT("consecutive " << consecutive << " n " << n << " batch " << b) {
+          BOOST_CHECK(std::equal(best.words.begin(), best.words.end(), out.result.begin() + b * dag.prelen));
+          BOOST_CHECK_CLOSE(best.score, out.score[b], 1e-3);
+        }
+      }
+    }
+  }
+}
+
+// The best path repeats words and n-grams of every size, and is longer than a HistoryChunk. Each position has a
+// second word from the same few and a word of its own that is never banned; with top_p 0.6 the others are only
+// expanded when the first is banned, so the search stays small enough to enumerate.
+BOOST_AUTO_TEST_CASE(RepeatBlockingChain) {
+  const int pattern[] = {3, 4, 3, 4, 3, 4, 5, 5, 5, 3, 4, 5, 3, 4, 5, 3, 3, 4, 4, 3};
+  const int prelen = sizeof(pattern) / sizeof(pattern[0]) + 1;
+  Dag dag(1, prelen, 3);
+  for (int i = 0; i + 1 < prelen; ++i) {
+    dag.Set(0, i, 0, i + 1, pattern[i], std::log(0.7f));
+    dag.Set(0, i, 1, i + 1, 3 + (pattern[i] - 2) % 3, std::log(0.2f - 0.005f * i));
+    dag.Set(0, i, 2, i + 1, 10 + i, std::log(0.1f - 0.002f * i));
+  }
+  CheckRepeatBlocking(dag, 10 + prelen, 0.6f);
+}
+
+// Short chains over three words with every candidate in play. The words of a position differ, otherwise the search
+// would merge the paths through the same word into one hypothesis.
+BOOST_AUTO_TEST_CASE(RepeatBlockingRandom) {
+  std::mt19937 gen(2);
+  for (int round = 0; round < 10; ++round) {
+    Dag dag = RandomDag(gen, 3, 8, 3);
+    for (int b = 0; b < dag.batch_size; ++b) {
+      for (int i = 0; i < dag.prelen; ++i) {
+        int words[] = {3, 4, 5};
+        std::shuffle(words, words + 3, gen);
+        for (int k = 0; k < dag.top_cand_n; ++k) {
+          std::size_t at = ((std::size_t)b * dag.prelen + i) * dag.top_cand_n + k;
+          dag.nextstep_idx[at] = std::min(i + 1, dag.prelen - 1);
+          dag.logits_idx[at] = words[k];
+        }
+      }
+    }
+    CheckRepeatBlocking(dag, kVocabSize, 0.8f);
+  }
+}
+
+// search_csr on the CSR form of a dense batch returns the same results and scores as search. Pruning the rows to top_p
+// is only equivalent without repeat blocking, which may expand the candidates after a banned one.
+BOOST_AUTO_TEST_CASE(CsrMatchesDense) {
+  std::mt19937 gen(3);
+  for (int round = 0; round < 10; ++round) {
+    Dag dag = RandomDag(gen, 4, 12, 4);
+    Searcher searcher(dag, ArpaPath());
+    for (int recombine = RECOMBINE_NONE; recombine <= RECOMBINE_LOGSUMEXP; ++recombine) {
+      for (int blocking = 0; blocking < 2; ++blocking) {
+        SearchOptions options = Options(recombine);
+        options.beam_size = 16;
+        options.beamlensize = 4;
+        options.no_consecutive_repeat_ngram = blocking ? 2 : 0;
+        options.no_repeat_ngram = blocking ? 3 : 0;
+        Output dense = searcher.Search(dag, options);
+        for (int prune = 0; prune <= 1 - blocking; ++prune) {
+          CsrDag csr(dag, prune, options.top_p);
+          Output sparse = searcher.SearchCsr(dag, csr, options);
+          BOOST_TEST_CONTEXT("recombine " << recombine << " blocking " << blocking << " prune " << prune) {
+            BOOST_CHECK(dense.result == sparse.result);
+            BOOST_CHECK(dense.score == sparse.score);
+          }
+        }
+      }
+    }
+  }
+}
+
+// A search started from a thread that allows dynamic teams still runs with every thread of the searcher. With more
+// threads than processors, such a team would be smaller than that of the previous search, whose notifies of the
+// threads left out would then be read again.
+BOOST_AUTO_TEST_CASE(SearchFromOtherThread) {
+  std::mt19937 gen(7);
+  Dag first = RandomDag(gen, 4, 10, 4), second = RandomDag(gen, 4, 10, 4);
+  Searcher searcher(first, ArpaPath(), 256, kVocabSize, omp_get_num_procs() + 2);
+  SearchOptions options = Options(RECOMBINE_MAX);
+  Output expected = searcher.Search(second, options);
+  searcher.Search(first, options);
+  Output out;
+  std::thread worker([&] {
+    omp_set_dynamic(1);
+    out = searcher.Search(second, options);
+  });
+  worker.join();
+  BOOST_CHECK(out.result == expected.result);
+  BOOST_CHECK(out.score == expected.score);
+}
+
+} // namespace
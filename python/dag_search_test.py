@@ -0,0 +1,166 @@
+# Tests of the Python interface of dag_search (score dtypes, strided inputs, output buffers). Build the extension first
+# (pip install . or python setup.py build_ext --inplace), then run python python/dag_search_test.py.
+import os
+import unittest
+
+import numpy as np
+
+import dag_search
+
+ARPA = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "lm", "test.arpa")
+
+class Dictionary:
+    symbols = ["<pad>", "<s>", "</s>", "a", "the", "is", "little", "more", "look", "watch", "in", "zzunk1", "zzunk2"]
+
+def random_dag(seed, batch_size=4, prelen=12, top_cand_n=4):
+    # Candidates sorted by descending score like the model output, items of different lengths.
+    rng = np.random.RandomState(seed)
+    output_length = rng.randint(2, prelen + 1, size=batch_size).astype(np.intc)
+    dagscores = np.zeros((batch_size, prelen, top_cand_n), np.float32)
+    nextstep_idx = np.zeros((batch_size, prelen, top_cand_n), np.intc)
+    logits_idx = np.zeros((batch_size, prelen, top_cand_n), np.intc)
+    for b in range(batch_size):
+        for i in range(prelen):
+            dagscores[b, i] = np.log(np.sort(rng.dirichlet(np.ones(top_cand_n) * 0.5))[::-1] + 1e-6)
+            nextstep_idx[b, i] = np.minimum(i + 1 + rng.randint(0, 3, size=top_cand_n), max(output_length[b] - 1, i + 1))
+            logits_idx[b, i] = rng.randint(3, len(Dictionary.symbols), size=top_cand_n)
+    return dagscores, nextstep_idx, logits_idx, output_length
+
+def bfloat16_bits(x):
+    # The upper half of the float32 bits, as the model's bfloat16 scores would be.
+    return (np.ascontiguousarray(x, dtype=np.float32).view(np.uint32) >> 16).astype(np.uint16)
+
+def from_bfloat16_bits(bits):
+    return (bits.astype(np.uint32) << 16).view(np.float32)
+
+class DLPackTensor:
+    # Exports an array only through DLPack, unversioned like the producers of NumPy < 2.1 unless versioned is set.
+    # With array_interface it also has __array__, as torch tensors do.
+    def __init__(self, array, versioned=False, array_interface=False):
+        self.array, self.versioned = array, versioned
+        if array_interface:
+            self.__array__ = lambda dtype=None, copy=None: self.array
+
+    def __dlpack__(self, stream=None, **kwargs):
+        return self.array.__dlpack__(**kwargs) if self.versioned else self.array.__dlpack__()
+
+    def __dlpack_device__(self):
+        return self.array.__dlpack_device__()
+
+def strided(array, rng):
+    # The same values inside a larger array with its axes permuted and gaps between the items.
+    shape = [n * 2 + 1 for n in array.shape]
+    order = rng.permutation(array.ndim)
+    base = np.zeros([shape[axis] for axis in order], dtype=array.dtype).transpose(np.argsort(order))
+    view = base[tuple(slice(1, None, 2) for _ in array.shape)]
+    view[...] = array
+    assert not view.flags.c_contiguous and np.shares_memory(view, base)
+    return view
+
+class DagSearchTest(unittest.TestCase):
+    def setUp(self):
+        self.searcher = dag_search.DagSearcher(4, 16, 4, 12, 48, 2, Dictionary(), ARPA)
+
+    def search(self, dagscores, nextstep_idx, logits_idx, output_length, **kwargs):
+        # alpha, gamma, beam_size, beamlensize, top_p, pad_id, go_id, dedup, no_consecutive_repeat_ngram, no_repeat_ngram
+        return self.searcher.search(dagscores, nextstep_idx, logits_idx, output_length, 1.1, 0.3, 16, 4, 0.9, 0, 1, 0, 2, 3,
+            dag_search.RECOMBINE_MAX, **kwargs)
+
+    def assertSameSearch(self, expected, got):
+        np.testing.assert_array_equal(expected[0], got[0])
+        np.testing.assert_array_equal(expected[1], got[1])
+
+    def test_float16(self):
+        dagscores, nextstep_idx, logits_idx, output_length = random_dag(1)
+        half = dagscores.astype(np.float16)
+        expected = self.search(half.astype(np.float32), nextstep_idx, logits_idx, output_length)
+        self.assertSameSearch(expected, self.search(half, nextstep_idx, logits_idx, output_length))
+        self.assertSameSearch(expected, self.search(half.view(np.int16), nextstep_idx, logits_idx, output_length,
+            score_dtype=dag_search.SCORE_FLOAT16))
+
+    def test_bfloat16_bits(self):
+        dagscores, nextstep_idx, logits_idx, output_length = random_dag(2)
+        bits = bfloat16_bits(dagscores)
+        expected = self.search(from_bfloat16_bits(bits), nextstep_idx, logits_idx, output_length)
+        for view in (bits, bits.view(np.int16)):
+            self.assertSameSearch(expected, self.search(view, nextstep_idx, logits_idx, output_length,
+                score_dtype=dag_search.SCORE_BFLOAT16))
+
+    def test_bfloat16_ml_dtypes(self):
+        try:
+            import ml_dtypes
+        except ImportError:
+            self.skipTest("ml_dtypes is not installed")
+        dagscores, nextstep_idx, logits_idx, output_length = random_dag(3)
+        bits = bfloat16_bits(dagscores)
+        expected = self.search(from_bfloat16_bits(bits), nextstep_idx, logits_idx, output_length)
+        self.assertSameSearch(expected, self.search(bits.view(ml_dtypes.bfloat16), nextstep_idx, logits_idx, output_length))
+
+    def test_bfloat16_torch(self):
+        try:
+            import torch
+        except ImportError:
+            self.skipTest("torch is not installed")
+        dagscores, nextstep_idx, logits_idx, output_length = random_dag(4)
+        tensor = torch.from_numpy(dagscores).to(torch.bfloat16)
+        expected = self.search(tensor.float().numpy(), nextstep_idx, logits_idx, output_length)
+        self.assertSameSearch(expected, self.search(tensor.view(torch.int16), torch.from_numpy(nextstep_idx),
+            torch.from_numpy(logits_idx), torch.from_numpy(output_length), score_dtype=dag_search.SCORE_BFLOAT16))
+
+    def test_score_dtype_checked(self):
+        dagscores, nextstep_idx, logits_idx, output_length = random_dag(5)
+        with self.assertRaises(AssertionError):
+            self.search(dagscores, nextstep_idx, logits_idx, output_length, score_dtype=dag_search.SCORE_BFLOAT16)
+        with self.assertRaises(AssertionError):
+            self.search(bfloat16_bits(dagscores), nextstep_idx, logits_idx, output_length, score_dtype=dag_search.SCORE_FLOAT32)
+
+    def test_strided_inputs(self):
+        rng = np.random.RandomState(6)
+        inputs = random_dag(6)
+        for dagscores in (inputs[0], inputs[0].astype(np.float16)):
+            reference = self.search(dagscores, *inputs[1:])
+            views = [strided(array, rng) for array in (dagscores,) + inputs[1:]]
+            self.assertSameSearch(reference, self.search(*views))
+            self.assertSameSearch(reference, self.search(*[DLPackTensor(view, versioned=True) for view in views]))
+            self.assertSameSearch(reference, self.search(*[DLPackTensor(view) for view in views]))
+
+    def test_preallocated_outputs(self):
+        inputs = random_dag(7)
+        expected = self.search(*inputs)
+        batch_size, prelen = inputs[0].shape[:2]
+        for wrap in (lambda array: array, lambda array: DLPackTensor(array, versioned=True),
+                lambda array: DLPackTensor(array, array_interface=True)):
+            result = np.full((batch_size + 1, prelen + 3), -1, dtype=np.intc)
+            score = np.full(batch_size + 2, -1, dtype=np.float32)
+            got = self.search(*inputs, result=wrap(result), score=wrap(score))
+            self.assertSameSearch(expected, got)
+            self.assertTrue(np.shares_memory(got[0], result) and np.shares_memory(got[1], score))
+            np.testing.assert_array_equal(result[:batch_size, :expected[0].shape[1]], expected[0])
+            np.testing.assert_array_equal(score[:batch_size], expected[1])
+            self.assertTrue((result[batch_size] == -1).all() and (score[batch_size:] == -1).all())
+
+    def test_read_only_outputs(self):
+        inputs = random_dag(8)
+        batch_size, prelen = inputs[0].shape[:2]
+        result = np.zeros((batch_size, prelen), dtype=np.intc)
+        with self.assertRaisesRegex(AssertionError, "read-only"):
+            self.search(*inputs, result=DLPackTensor(result))
+        result.flags.writeable = False
+        with self.assertRaisesRegex(AssertionError, "read-only"):
+            self.search(*inputs, result=result)
+
+    def test_torch_outputs(self):
+        try:
+            import torch
+        except ImportError:
+            self.skipTest("torch is not installed")
+        inputs = random_dag(9)
+        expected = self.search(*inputs)
+        result = torch.zeros(inputs[0].shape[:2], dtype=torch.int32)
+        score = torch.zeros(inputs[0].shape[0], dtype=torch.float32)
+        self.search(*[torch.from_numpy(array) for array in inputs], result=result, score=score)
+        np.testing.assert_array_equal(result.numpy()[:, :expected[0].shape[1]], expected[0])
+        np.testing.assert_array_equal(score.numpy(), expected[1])
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,73 @@
+#include "HalfFloat.h"
+
+#define BOOST_TEST_MODULE HalfFloatTest
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace {
+
+// binary16 decoded from its definition
+double ReferenceHalf(uint16_t bits) {
+  int sign = bits >> 15, exponent = (bits >> 10) & 0x1f, mantissa = bits & 0x3ff;
+  double magnitude;
+  if (exponent == 0x1f) magnitude = mantissa ? std::numeric_limits<double>::quiet_NaN() : INFINITY;
+  else if (exponent == 0) magnitude = std::ldexp(mantissa, -24);
+  else magnitude = std::ldexp(1024 + mantissa, exponent - 25);
+  return sign ? -magnitude : magnitude;
+}
+
+BOOST_AUTO_TEST_CASE(HalfToFloatAll) {
+  for (uint32_t bits = 0; bits < 0x10000; ++bits) {
+    double reference = ReferenceHalf(bits);
+    float value = to_float(Half{(uint16_t)bits});
+    if (std::isnan(reference)) {
+      BOOST_CHECK(std::isnan(value));
+    } else {
+      BOOST_CHECK_EQUAL(reference, value);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(HalfRoundTrip) {
+  // every finite half converts back to itself
+  for (uint32_t bits = 0; bits < 0x10000; ++bits) {
+    if ((bits & 0x7c00) == 0x7c00) continue;
+    BOOST_CHECK_EQUAL(bits, float_to_half(to_float(Half{(uint16_t)bits})).bits);
+  }
+  BOOST_CHECK_EQUAL(0x7c00, float_to_half(INFINITY).bits);
+  BOOST_CHECK_EQUAL(0xfc00, float_to_half(-70000.0f).bits);
+  BOOST_CHECK(std::isnan(to_float(float_to_half(NAN))));
+}
+
+BOOST_AUTO_TEST_CASE(FloatToHalfRounding) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> exponent(-26.0f, 16.0f);
+  for (int i = 0; i < 200000; ++i) {
+    float value = std::exp2(exponent(gen)) * (i & 1 ? -1 : 1);
+    Half half = float_to_half(value);
+    float rounded = to_float(half);
+    // no other half is closer, and ties go to the even mantissa
+    Half up = {(uint16_t)(half.bits + 1)}, down = {(uint16_t)(half.bits - 1)};
+    double error = std::fabs((double)rounded - value);
+    if ((half.bits & 0x7fff) != 0x7c00) BOOST_CHECK_LE(error, std::fabs((double)to_float(up) - value));
+    if ((half.bits & 0x7fff) != 0) BOOST_CHECK_LE(error, std::fabs((double)to_float(down) - value));
+  }
+  BOOST_CHECK_EQUAL(0x3c00, float_to_half(1.0f + std::ldexp(1.0f, -11)).bits); // tie, even is 1.0
+  BOOST_CHECK_EQUAL(0x3c02, float_to_half(1.0f + 3 * std::ldexp(1.0f, -11)).bits); // tie, even is 1 + 2^-9
+}
+
+BOOST_AUTO_TEST_CASE(BFloat16RoundTrip) {
+  for (uint32_t bits = 0; bits < 0x10000; ++bits) {
+    float value = to_float(BFloat16{(uint16_t)bits});
+    if (std::isnan(value)) continue;
+    BOOST_CHECK_EQUAL(bits, float_to_bfloat16(value).bits);
+  }
+  BOOST_CHECK_EQUAL(0x3f80, float_to_bfloat16(1.0f + std::ldexp(1.0f, -8)).bits); // tie, even is 1.0
+  BOOST_CHECK_EQUAL(0x3f81, float_to_bfloat16(1.0f + std::ldexp(1.0f, -7) + std::ldexp(1.0f, -9)).bits);
+  BOOST_CHECK(std::isnan(to_float(float_to_bfloat16(NAN))));
+}
+
+} // namespace
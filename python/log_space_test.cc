@@ -0,0 +1,85 @@
+#include "LogSpace.h"
+
+#define BOOST_TEST_MODULE LogSpaceTest
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace {
+
+double ReferenceLogAddExp(double a, double b) {
+  double l = std::max(a, b);
+  return l + std::log1p(std::exp(-std::fabs(a - b)));
+}
+
+// Absolute tolerance plus one ulp of the result, which is what storing the exact value as a float costs anyway.
+void CheckClose(float value, double reference, double tolerance) {
+  double ulp = std::nextafter((float)std::fabs(reference), INFINITY) - (float)std::fabs(reference);
+  BOOST_CHECK_LE(std::fabs(value - reference), tolerance + ulp);
+}
+
+BOOST_AUTO_TEST_CASE(Log1pExpTableAccuracy) {
+  double max_err = 0;
+  for (int i = 0; i < Log1pExpTable::range * 1000; ++i) {
+    float d = i / 1000.0f;
+    max_err = std::max(max_err, std::fabs(log1pexp_table(d) - std::log1p(std::exp(-(double)d))));
+  }
+  BOOST_CHECK_LT(max_err, 1.5e-7);
+}
+
+BOOST_AUTO_TEST_CASE(FastLogAddExpAccuracy) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> base(-200.0f, 5.0f), diff(0.0f, 30.0f);
+  for (int i = 0; i < 200000; ++i) {
+    float a = base(gen);
+    float b = a - diff(gen);
+    if (i & 1) std::swap(a, b);
+    double reference = ReferenceLogAddExp(a, b);
+    CheckClose(fast_logaddexp(a, b), reference, 2e-7);
+    // the exact version is held to the same bound, so fast is not worse than what we had
+    CheckClose(exact_logaddexp(a, b), reference, 2e-7);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(LogAddExpInfinity) {
+  const float inf = std::numeric_limits<float>::infinity();
+  BOOST_CHECK_EQUAL(-inf, fast_logaddexp(-inf, -inf));
+  BOOST_CHECK_EQUAL(-3.5f, fast_logaddexp(-inf, -3.5f));
+  BOOST_CHECK_EQUAL(-3.5f, fast_logaddexp(-3.5f, -inf));
+  BOOST_CHECK_EQUAL(exact_logaddexp(-inf, -inf), fast_logaddexp(-inf, -inf));
+  BOOST_CHECK_CLOSE(std::log(2.0f), fast_logaddexp(0.0f, 0.0f), 1e-4);
+}
+
+BOOST_AUTO_TEST_CASE(FastExpAccuracy) {
+  for (int i = 0; i <= 870000; ++i) {
+    float x = -i / 10000.0f;
+    double reference = std::exp((double)x);
+    BOOST_REQUIRE_LE(std::fabs(fast_exp_nonpositive(x) - reference), 2e-7 * reference);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(FastLogSumExpAccuracy) {
+  std::mt19937 gen(2);
+  std::uniform_real_distribution<float> score(-50.0f, 0.0f);
+  std::uniform_int_distribution<int> length(1, 300);
+  std::vector<float> values;
+  for (int i = 0; i < 2000; ++i) {
+    values.resize(length(gen));
+    for (float &value : values) value = score(gen);
+    if (i % 10 == 0) values[0] = -std::numeric_limits<float>::infinity();
+    double l = -INFINITY, sum = 0;
+    for (float value : values) l = std::max(l, (double)value);
+    for (float value : values) sum += std::exp(value - l);
+    double reference = l + std::log(sum);
+    CheckClose(fast_logsumexp(values.data(), values.size()), reference, 4e-7 * (1 + std::log(values.size())));
+    CheckClose(exact_logsumexp(values.data(), values.size()), reference, 4e-7 * (1 + std::log(values.size())));
+  }
+  const float inf = std::numeric_limits<float>::infinity();
+  float all_inf[3] = {-inf, -inf, -inf};
+  BOOST_CHECK_EQUAL(-inf, fast_logsumexp(all_inf, 3));
+}
+
+} // namespace
@@ -1,4 +1,9 @@
+#ifdef DAG_SEARCH_NO_PYTHON // standalone builds (e.g. dag_search_bench) fill the struct themselves
+#include <cstddef>
+typedef std::ptrdiff_t Py_ssize_t;
+#else
 #include "Python.h"
+#endif
 struct __pyx_memoryview_obj;
 typedef struct {
   struct __pyx_memoryview_obj *memview;
@@ -6,4 +11,4 @@ typedef struct {
   Py_ssize_t shape[8];
   Py_ssize_t strides[8];
   Py_ssize_t suboffsets[8];
-} __Pyx_memviewslice;
\ No newline at end of file
+} __Pyx_memviewslice;
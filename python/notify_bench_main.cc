@@ -0,0 +1,154 @@
+// Microbenchmark of notify insertion: every thread publishes its notifies either by exchanging them into one shared
+// atomic head per bucket (the scheme used before per-thread segments) or by linking them into its own segments.
+// The read side walks all buckets, like stage 1 of DagSearcher::get_beam.
+#include "SearchBeam.h"
+#include "../util/exception.hh"
+
+#include <boost/program_options.hpp>
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Times {
+  double write, read;
+  long notifies;
+};
+
+struct LocalList {
+  Notify *head, *tail;
+};
+
+// Each round every thread inserts `inserts` notifies into random buckets, collecting them per bucket first
+// (like NotifyCache::local_head), and then publishes them. The bucket lists are walked after every round.
+Times Run(bool shared, int threads, int buckets, int inserts, int rounds, int seed) {
+  MultiThreadMemPool<Notify> ntf_pool;
+  MultiThreadMemPool<NotifySegment> seg_pool;
+  ntf_pool.init_global(0, threads);
+  seg_pool.init_global(0, threads);
+  std::vector<std::atomic<Notify*> > heads(buckets);
+  std::vector<std::vector<NotifySegment*> > segments(threads, std::vector<NotifySegment*>(buckets));
+  std::vector<std::vector<LocalList> > local(threads, std::vector<LocalList>(buckets));
+  std::vector<std::vector<int> > touched(threads);
+  std::vector<long> counts(buckets);
+  Times times = {0, 0, 0};
+
+  #pragma omp parallel num_threads(threads)
+  {
+    ntf_pool.clear_thread();
+    seg_pool.clear_thread();
+  }
+  for (int b = 0; b < buckets; ++b) heads[b].store(nullptr, std::memory_order_relaxed);
+  for (int round = 0; round < rounds; ++round) {
+    double start = omp_get_wtime();
+    #pragma omp parallel num_threads(threads)
+    {
+      int t = omp_get_thread_num();
+      std::mt19937 gen(seed + round * threads + t);
+      std::uniform_int_distribution<int> bucket_dist(0, buckets - 1);
+      std::vector<LocalList> &my_local = local[t];
+      std::vector<int> &my_touched = touched[t];
+      for (int n = 0; n < inserts; ++n) {
+        int b = bucket_dist(gen);
+        Notify* now = ntf_pool.allocate();
+        now->target = nullptr;
+        now->next = my_local[b].head;
+        if (my_local[b].head == nullptr) {
+          my_local[b].tail = now;
+          my_touched.push_back(b);
+        }
+        my_local[b].head = now;
+      }
+      for (int b : my_touched) {
+        if (shared) {
+          my_local[b].tail->next = heads[b].exchange(my_local[b].head, std::memory_order_relaxed);
+        } else {
+          NotifySegment* segment = seg_pool.allocate();
+          segment->head = my_local[b].head;
+          segment->next = segments[t][b];
+          segments[t][b] = segment;
+        }
+        my_local[b].head = my_local[b].tail = nullptr;
+      }
+      my_touched.clear();
+    }
+    double middle = omp_get_wtime();
+    #pragma omp parallel for num_threads(threads) schedule(guided)
+    for (int b = 0; b < buckets; ++b) {
+      long count = 0;
+      if (shared) {
+        for (Notify* now = heads[b].load(std::memory_order_relaxed); now; now = now->next) ++count;
+      } else {
+        for (int t = 0; t < threads; ++t) {
+          for (NotifySegment* segment = segments[t][b]; segment; segment = segment->next) {
+            for (Notify* now = segment->head; now; now = now->next) ++count;
+          }
+        }
+      }
+      counts[b] = count;
+    }
+    double end = omp_get_wtime();
+    times.write += middle - start;
+    times.read += end - middle;
+    for (int b = 0; b < buckets; ++b) times.notifies += counts[b];
+  }
+  long expected = 0;
+  for (int round = 0; round < rounds; ++round) expected += (long)(round + 1) * threads * inserts;
+  UTIL_THROW_IF2(times.notifies != expected, "Lost notifies: " << times.notifies << " != " << expected);
+  return times;
+}
+
+std::vector<int> ParseList(const std::string &str) {
+  std::vector<int> res;
+  std::stringstream stream(str);
+  std::string item;
+  while (std::getline(stream, item, ',')) res.push_back(std::stoi(item));
+  UTIL_THROW_IF2(res.empty(), "Empty list " << str);
+  return res;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    std::string thread_list;
+    int buckets, inserts, rounds, seed;
+    namespace po = boost::program_options;
+    po::options_description options("Notify insertion benchmark options");
+    options.add_options()
+      ("help,h", po::bool_switch(), "Show help message")
+      ("threads,t", po::value<std::string>(&thread_list)->default_value("1,2,4,8,16,32,64"), "Comma-separated thread counts")
+      ("buckets", po::value<int>(&buckets)->default_value(64), "Number of (pos, length) buckets written in a step")
+      ("inserts", po::value<int>(&inserts)->default_value(4096), "Notifies inserted by each thread per round")
+      ("rounds,r", po::value<int>(&rounds)->default_value(50), "Rounds (expand_beam calls) per measurement")
+      ("seed", po::value<int>(&seed)->default_value(1), "Seed for bucket choice");
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    if (vm["help"].as<bool>()) {
+      std::cerr << options << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+    UTIL_THROW_IF2(buckets <= 0 || inserts <= 0 || rounds <= 0, "--buckets, --inserts and --rounds should be positive");
+
+    std::cout << "threads\tshared_write_ns\tshared_read_ns\tsegment_write_ns\tsegment_read_ns" << std::endl;
+    for (int threads : ParseList(thread_list)) {
+      Times shared = Run(true, threads, buckets, inserts, rounds, seed);
+      Times segment = Run(false, threads, buckets, inserts, rounds, seed);
+      // per notify inserted (write) or visited (read)
+      double inserted = (double)threads * inserts * rounds;
+      std::cout << std::fixed << std::setprecision(2) << threads << '\t'
+        << shared.write * 1e9 / inserted << '\t' << shared.read * 1e9 / shared.notifies << '\t'
+        << segment.write * 1e9 / inserted << '\t' << segment.read * 1e9 / segment.notifies << std::endl;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -48,11 +48,11 @@ if compile_test('lzma.h', 'lzma'):
 
 from setuptools import setup
 from Cython.Build import cythonize
-cythonize("python/dag_search.pyx")
+cythonize("python/dag_search.pyx", force=True)
 
 ext_modules = [
     Extension(name='dag_search',
-        sources=FILES + ['python/dag_search.cpp', 'python/SearchBeam.cpp'],
+        sources=FILES + ['python/dag_search.cpp', 'python/SearchBeam.cpp', 'python/LogSpace.cpp'],
         language='C++', 
         include_dirs=['.'],
         libraries=LIBS, 